@@ -0,0 +1,746 @@
+/*
+ * File:   air.c
+ *
+ * The scripted other end of the link. For the switch build (mode 1) every
+ * press becomes a burst of packets from a remote that behaves like
+ * button_action() and stops at the first ACK. For the remote build
+ * (mode 0) every press pulls the button pin low, the packets the firmware
+ * sends are collected here, and a switch listening for air_config.window
+ * every air_config.period acknowledges the ones it hears. Like the
+ * listen governor it then wakes every air_config.fast for a while, on a
+ * Timer1 clock off by air_config.skew that its ACKs carry.
+ *
+ * Both ends start on air_config.home. A switch that has moved to
+ * air_config.moved_to says so in its ACKs and still listens on home
+ * every HOME_EVERY wake-ups; the scripted remote follows the ACKs and
+ * falls back to home for another burst when one goes unanswered. With
+ * air_config.hopping the scripted switch hops through hop_sequence
+ * instead, and the scripted remote works out where the switch firmware
+ * listens from the place in hop_sequence its last ACK named, counting
+ * its wake-ups since on the schedule a command starts, and bursts on home
+ * until it has one or after a miss. The
+ * data rate works like the channel: a scripted switch at air_config.rate
+ * announces it, the scripted remote follows (or starts on it, remembering
+ * a switch that was at that rate) and falls back to
+ * air_config.home_rate; either end hears the other at air_config.dbm. An
+ * interferer air_config.busy_channel wide as a Wi-Fi channel garbles
+ * packets and sets the RPD.
+ *
+ * The scripted remote sends the command (and CRC) in the payload format
+ * set by air_config.fec_copies, air_config.crc and air_config.frames,
+ * which must match the switch build (see <FEC>, <CRC> and <FRAMES> in
+ * transceiver.c); unless set, air_config.frames follows it. The encoders
+ * here are written independently of the firmware so the two check
+ * each other.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "sim.h"
+
+#define MAX_PRESSES 64
+
+struct press {
+    sim_time_t at;
+    int on;
+    // switch build: the scripted remote stops after this packet
+    unsigned long stop;
+    unsigned long length; // ...or this one, the end of the burst
+    int channel; // ...and sends its first burst packets on this one;
+                 // remote build: where the ACK came from
+    int rate; // ...at this rate, as rate_select counts them
+    sim_time_t airtime; // remote build: time on air
+    // remote build: what the firmware put on air for this press
+    unsigned char addr[5];
+    unsigned long packets;
+    unsigned long acked;
+    sim_time_t first, start, last, acked_at;
+    sim_time_t gap; // longest start-to-start time, a blind burst must
+                    // keep it short enough for every window to see one
+    // switch build: first relay pulse after the press
+    sim_time_t relay_at;
+    int relay_on;
+    unsigned long pulses;
+    int was_set; // the relay was already on the side asked for
+};
+
+struct air_config air_config = {
+    .loss = 0.0,
+    .fec_copies = 2,
+    .crc = 1,
+    .frames = -1,
+    .burst = 528,   // what burst_length nrf_transmit() calls put on air
+    .spacing = 380 * SIM_US, // (897 and 223 us with fec 0, 1022 and
+                             // 196 us with fec 0 and crc 0)
+    .hold = 200 * SIM_MS,
+    .period = 125 * SIM_MS,
+    .window = 1 * SIM_MS,
+    .fast = 50 * SIM_MS,
+    .fast_hold = 30 * SIM_S,
+    .home = 2,
+    .rate = -1,
+    .home_rate = 1,
+    .dbm = -50,
+};
+
+#define HOME_EVERY 16 // home_every in transceiver.c...
+#define HOP_HOME_EVERY 4 // ...with channel_select 2
+
+// channel_list and hop_sequence in transceiver.c
+static const int channel_list[] = { 2, 25, 50, 75, 80 };
+static const int hop_sequence[16] = { 0, 3, 2, 4, 0, 3, 2, 1, 0, 4, 1, 2, 0, 3, 1, 4 };
+
+// rate_select's 0, 1, 2 as RF_SETUP encodes them
+static const int rates[3] = { RATE_250K, RATE_1M, RATE_2M };
+static const char *const rate_names[3] = { "250 kbps", "1 Mbps", "2 Mbps" };
+#define BUSY_SLOT (500 * SIM_US) // the interferer is on or off this long
+
+static struct press presses[MAX_PRESSES];
+static int press_count;
+static int current_press = -1;
+static int button_down;
+static unsigned long wrong_pulses;
+static unsigned long stray_pulses;
+static int latched; // side of the last relay pulse, -1 before the first
+static int anchored; // the scripted switch is on its fast schedule...
+static double anchor; // ...counted from this wake-up, in its ticks
+static long anchor_wakes; // ...which was its this-many-th
+static int remote_channel; // where the scripted remote finds the switch
+static int remote_rate; // ...and at what rate
+static int remote_synced; // hopping: an ACK has named the switch's hop...
+static int remote_hop; // ...its place in hop_sequence then...
+static sim_time_t remote_hop_at; // ...and when that packet went out
+
+void air_press(sim_time_t at, int on) {
+    if (press_count == MAX_PRESSES) {
+        return;
+    }
+    // keep presses in time order
+    int i = press_count++;
+    while (i > 0 && presses[i - 1].at > at) {
+        presses[i] = presses[i - 1];
+        i--;
+    }
+    presses[i].at = at;
+    presses[i].on = on;
+}
+
+void air_reset(void) {
+    for (int i = 0; i < press_count; i++) {
+        presses[i].stop = presses[i].length = air_config.burst;
+        presses[i].channel = 0;
+        presses[i].rate = air_config.home_rate;
+        presses[i].airtime = 0;
+        presses[i].packets = 0;
+        presses[i].gap = 0;
+        presses[i].acked = 0;
+        presses[i].relay_at = 0;
+        presses[i].pulses = 0;
+    }
+    current_press = -1;
+    button_down = 0;
+    wrong_pulses = 0;
+    stray_pulses = 0;
+    latched = -1;
+    anchored = 0;
+    remote_channel = air_config.home;
+    remote_synced = 0;
+    remote_rate = air_config.rate >= 0 ? air_config.rate : air_config.home_rate;
+    sim_sfr.portc.RC2 = 1; // button has a pull-up
+}
+
+// the longest the interferer is on air over [from, to) on channel, it's
+// 20 MHz wide and on or off for whole slots, again repeatably
+sim_time_t air_busy(int channel, sim_time_t from, sim_time_t to) {
+    if (air_config.busy_duty <= 0 || to <= from
+        || channel < air_config.busy_channel - 10 || channel > air_config.busy_channel + 10) {
+        return 0;
+    }
+    sim_time_t longest = 0, run = 0;
+    for (unsigned long long n = from / BUSY_SLOT; n * BUSY_SLOT < to; n++) {
+        unsigned long long h = (n + 1) * 0xD6E8FEB86659FD93ULL;
+        h ^= h >> 32;
+        h *= 0xD6E8FEB86659FD93ULL;
+        h ^= h >> 32;
+        if ((double)(h & 0xFFFFFF) / 0x1000000 >= air_config.busy_duty) {
+            run = 0;
+            continue;
+        }
+        sim_time_t start = n * BUSY_SLOT, end = start + BUSY_SLOT;
+        run += (end < to ? end : to) - (start > from ? start : from);
+        if (run > longest) {
+            longest = run;
+        }
+    }
+    return longest;
+}
+
+// deterministic per-packet loss so runs are repeatable
+static int lost(long burst, unsigned long k) {
+    if (air_config.loss <= 0) {
+        return 0;
+    }
+    unsigned long long h = (unsigned long long)burst * 0x9E3779B97F4A7C15ULL ^ k;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return (double)(h & 0xFFFFFF) / 0x1000000 < air_config.loss;
+}
+
+// extended Hamming(8,4): data bits 3-0, parity bits 6-4, overall parity 7
+static unsigned char hamming(unsigned d) {
+    unsigned b0 = d & 1, b1 = d >> 1 & 1, b2 = d >> 2 & 1, b3 = d >> 3 & 1;
+    unsigned w = d | (b0 ^ b1 ^ b3) << 4 | (b0 ^ b2 ^ b3) << 5 | (b1 ^ b2 ^ b3) << 6;
+    return w | __builtin_parity(w) << 7;
+}
+
+// message nibbles (high first) repeated over len codewords, codeword
+// c bit b sent as payload bit b * len + c
+static void fec_payload(const unsigned char *msg, int msg_len, int len, unsigned char *out) {
+    memset(out, 0, len);
+    for (int c = 0; c < len; c++) {
+        int n = c % (2 * msg_len);
+        unsigned char w = hamming(n % 2 ? msg[n / 2] & 0x0F : msg[n / 2] >> 4);
+        for (int b = 0; b < 8; b++) {
+            if (w >> b & 1) {
+                int k = b * len + c;
+                out[k / 8] |= 1 << k % 8;
+            }
+        }
+    }
+}
+
+// CRC-16/CCITT-FALSE
+static unsigned crc16(const unsigned char *data, int len) {
+    unsigned crc = 0xFFFF;
+    for (int i = 0; i < len; i++) {
+        crc ^= data[i] << 8;
+        for (int b = 0; b < 8; b++) {
+            crc = (crc & 0x8000 ? crc << 1 ^ 0x1021 : crc << 1) & 0xFFFF;
+        }
+    }
+    return crc;
+}
+
+// deterministic bit errors, like lost()
+static int flipped(long burst, unsigned long k, int bit) {
+    unsigned long long h = ((unsigned long long)burst << 40 ^ (unsigned long long)k << 8 ^ bit)
+                           * 0xC2B2AE3D27D4EB4FULL;
+    h ^= h >> 29;
+    h *= 0x165667B19E3779F9ULL;
+    h ^= h >> 32;
+    return (double)(h & 0xFFFFFF) / 0x1000000 < air_config.ber;
+}
+
+static sim_time_t packet_start(int burst, unsigned long k);
+
+// hopping: the channel of the switch's window nearest t by the scripted
+// remote's count, home until an ACK has said where the switch was
+static int hop_channel(sim_time_t t) {
+    if (!remote_synced) {
+        return air_config.home;
+    }
+    sim_time_t fast = air_config.fast ? air_config.fast : air_config.period;
+    sim_time_t span = air_config.fast ? air_config.fast_hold / fast * fast : 0;
+    double d = t > remote_hop_at ? (double)(t - remote_hop_at) : 0;
+    long wakes;
+    if (d < span) {
+        wakes = (long)floor(d / fast + 0.5);
+    } else {
+        wakes = (long)(span / fast) + (long)floor((d - span) / air_config.period + 0.5);
+    }
+    return channel_list[hop_sequence[(remote_hop + wakes) % 16]];
+}
+
+// channel of packet k of a press: the one the last ACK named, home once
+// the burst is over
+static int press_channel(int burst, unsigned long k) {
+    if (k >= air_config.burst) {
+        return air_config.home;
+    }
+    if (air_config.hopping) {
+        return hop_channel(packet_start(burst, k));
+    }
+    return burst > current_press ? remote_channel : presses[burst].channel;
+}
+
+static int press_rate(int burst, unsigned long k) {
+    if (k >= air_config.burst) {
+        return air_config.home_rate;
+    }
+    return burst > current_press ? remote_rate : presses[burst].rate;
+}
+
+// payload bytes of an n-byte message (and CRC) in the remote's format
+static int remote_width(int n) {
+    n += air_config.crc ? 2 : 0;
+    return air_config.fec_copies ? 2 * n * air_config.fec_copies : n;
+}
+
+// the frame the scripted remote sends, 0 for the command character; by
+// default the switch build's: its pipe 0 is as wide as a full frame
+// (1 + frame_records bytes) only with command_frames
+static int remote_frames(void) {
+    if (air_config.frames >= 0) {
+        return air_config.frames;
+    }
+    return radio_pipe_width(0) == remote_width(3);
+}
+
+// command frame for a press, FRAME_MARK and the sequence number first
+// (FRAME_* in transceiver.c); returns its length
+static int frame(int burst, unsigned char *msg) {
+    int on = presses[burst].on;
+    int n = 0;
+    msg[n++] = 0xA0 | ((burst + 1) & 0x0F); // FRAME_MARK
+    switch (remote_frames()) {
+        case 2:
+            msg[n++] = 0x21; // FRAME_TARGET unit 1, device_unit
+            msg[n++] = 0x10 | on; // FRAME_SET
+            break;
+        case 3:
+            msg[n++] = 0x30 | !on; // FRAME_SCENE
+            break;
+        case 4:
+            msg[n++] = 0x22; // FRAME_TARGET unit 2, another switch
+            msg[n++] = 0x10 | on;
+            break;
+        default:
+            msg[n++] = 0x10 | on;
+    }
+    // group pipes have a fixed width, FRAME_NOP up to frame_records
+    while (air_config.addr && n < 3) {
+        msg[n++] = 0x00;
+    }
+    return n;
+}
+
+// payload bytes the scripted remote sends
+static int remote_length(void) {
+    unsigned char msg[8];
+    return remote_width(remote_frames() ? frame(0, msg) : 2);
+}
+
+static sim_time_t remote_airtime(int rate) {
+    air_packet_t pkt;
+    memset(&pkt, 0, sizeof(pkt));
+    radio_air_format(&pkt);
+    pkt.len = remote_length();
+    pkt.rate = rates[rate];
+    return radio_airtime(&pkt);
+}
+
+// start-to-start time of its packets at a rate: air_config.spacing is at
+// 1 Mbps, the gap after each packet stays, but for an ARD 500 us longer
+// at 250 kbps
+static sim_time_t remote_spacing(int rate) {
+    return air_config.spacing + remote_airtime(rate) - remote_airtime(1)
+           + (rate == 0 ? 500 * SIM_US : 0);
+}
+
+// when packet k of a press starts...
+static sim_time_t packet_start(int burst, unsigned long k) {
+    sim_time_t at = presses[burst].at;
+    if (air_config.hopping) {
+        return at + k * air_config.spacing;
+    }
+    sim_time_t first = remote_spacing(press_rate(burst, 0));
+    if (k <= air_config.burst) {
+        return at + k * first;
+    }
+    return at + air_config.burst * first + (k - air_config.burst) * remote_spacing(air_config.home_rate);
+}
+
+// ...and the first one that starts at or after t
+static unsigned long packet_at(int burst, sim_time_t t) {
+    sim_time_t at = presses[burst].at;
+    if (t <= at) {
+        return 0;
+    }
+    if (air_config.hopping) {
+        return (t - at + air_config.spacing - 1) / air_config.spacing;
+    }
+    sim_time_t first = remote_spacing(press_rate(burst, 0));
+    unsigned long k = (t - at + first - 1) / first;
+    if (k <= air_config.burst) {
+        return k;
+    }
+    sim_time_t rest = remote_spacing(air_config.home_rate);
+    sim_time_t fallback = at + air_config.burst * first;
+    return air_config.burst + (t - fallback + rest - 1) / rest;
+}
+
+// the scripted remote: same address and format the switch has
+// configured its own radio with
+static void remote_packet(int burst, unsigned long k, air_packet_t *pkt) {
+    memset(pkt, 0, sizeof(*pkt));
+    radio_air_format(pkt);
+    if (air_config.addr) {
+        memcpy(pkt->addr, air_config.addr, 5);
+    }
+    pkt->channel = press_channel(burst, k);
+    pkt->rate = rates[press_rate(burst, k)];
+    pkt->burst = burst;
+    // command and sequence number, a new one for every press
+    unsigned char msg[8] = { presses[burst].on ? '1' : 'N', burst + 1 };
+    int msg_len = 2;
+    if (remote_frames()) {
+        msg_len = frame(burst, msg);
+    }
+    if (air_config.crc) {
+        unsigned crc = crc16(msg, msg_len);
+        msg[msg_len++] = crc >> 8;
+        msg[msg_len++] = crc & 0xFF;
+    }
+    if (air_config.fec_copies) {
+        pkt->len = 2 * msg_len * air_config.fec_copies;
+        fec_payload(msg, msg_len, pkt->len, pkt->payload);
+    } else {
+        pkt->len = msg_len;
+        memcpy(pkt->payload, msg, msg_len);
+    }
+    pkt->crc_ok = 1;
+    if (air_config.ber > 0) {
+        for (int bit = 0; bit < pkt->len * 8; bit++) {
+            if (flipped(burst, k, bit)) {
+                pkt->payload[bit / 8] ^= 1 << bit % 8;
+                pkt->crc_ok = 0;
+            }
+        }
+    }
+    pkt->start = packet_start(burst, k);
+    pkt->end = pkt->start + radio_airtime(pkt);
+    if (air_busy(pkt->channel, pkt->start, pkt->end)) {
+        for (int i = 0; i < pkt->len; i++) {
+            pkt->payload[i] ^= 0xA5; // the collision garbles it
+        }
+        pkt->crc_ok = 0;
+    }
+}
+
+// garbage frame k: random payload, CRC (if the radio checks one) bad
+static void noise_packet(unsigned long k, air_packet_t *pkt) {
+    memset(pkt, 0, sizeof(*pkt));
+    radio_air_format(pkt);
+    pkt->len = 32;
+    for (int i = 0; i < 32; i++) {
+        unsigned long long h = ((unsigned long long)k << 8 | i) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 31;
+        pkt->payload[i] = h >> 24;
+    }
+    pkt->crc_ok = 0;
+    pkt->noack = 1;
+    pkt->start = k * (sim_time_t)(SIM_S / air_config.noise);
+    pkt->end = pkt->start + radio_airtime(pkt);
+}
+
+int air_next(sim_time_t from, sim_time_t after, air_packet_t *pkt) {
+    int found = 0;
+    if (air_config.noise > 0) {
+        sim_time_t period = (sim_time_t)(SIM_S / air_config.noise);
+        air_packet_t cand;
+        noise_packet(0, &cand);
+        sim_time_t airtime = cand.end - cand.start;
+        unsigned long k = (from + period - 1) / period;
+        if (after + 1 > airtime) {
+            unsigned long k2 = (after + 1 - airtime + period - 1) / period;
+            if (k2 > k) {
+                k = k2;
+            }
+        }
+        noise_packet(k, pkt);
+        found = 1;
+    }
+    for (int b = 0; b < press_count; b++) {
+        // the first packet from `from` on that ends after `after`
+        air_packet_t cand;
+        unsigned long k = packet_at(b, from);
+        for (;;) {
+            while (k < presses[b].stop && lost(b, k)) {
+                k++;
+            }
+            if (k >= presses[b].stop) {
+                break;
+            }
+            remote_packet(b, k, &cand);
+            if (cand.end > after) {
+                break;
+            }
+            sim_time_t airtime = cand.end - cand.start;
+            unsigned long k2 = packet_at(b, after + 1 > airtime ? after + 1 - airtime : 0);
+            k = k2 > k ? k2 : k + 1;
+        }
+        if (k >= presses[b].stop) {
+            continue;
+        }
+        if (!found || cand.end < pkt->end) {
+            *pkt = cand;
+            found = 1;
+        }
+    }
+    return found;
+}
+
+// the switch acknowledged pkt, with len bytes of payload
+void air_ack(const air_packet_t *pkt, const unsigned char *payload, int len) {
+    if (pkt->burst < 0) {
+        return;
+    }
+    air_packet_t ack = *pkt;
+    ack.pcf = 1;
+    ack.len = len;
+    ack.start = pkt->end + 130 * SIM_US;
+    if (air_busy(ack.channel, ack.start, ack.start + radio_airtime(&ack))) {
+        return; // the remote never hears it
+    }
+    struct press *p = &presses[pkt->burst];
+    unsigned long k = packet_at(pkt->burst, pkt->start);
+    if (k + 1 < p->stop) {
+        p->stop = k + 1;
+    }
+    if (len >= 5 && air_config.hopping) {
+        remote_synced = 1;
+        remote_hop = payload[4];
+        remote_hop_at = pkt->start;
+        p->channel = pkt->channel;
+    } else if (len >= 5) {
+        remote_channel = payload[4];
+    }
+    if (len >= 6 && payload[5] < 3) {
+        remote_rate = payload[5];
+    }
+}
+
+// the scripted switch's Timer1, 3875 Hz give or take air_config.skew
+static double switch_ticks(sim_time_t t) {
+    return (double)t * 3875 * (1 + air_config.skew) / SIM_S;
+}
+
+static sim_time_t switch_time(double ticks) {
+    return (sim_time_t)(ticks * SIM_S / (3875 * (1 + air_config.skew)) + 0.5);
+}
+
+// a period in whole ticks, as timer1_ticks() rounds it
+static double period_ticks(sim_time_t period) {
+    return ceil((double)period * 3875 / SIM_S - 1e-9);
+}
+
+// its last wake-up at or before tick c: every period, or after an ACK
+// every fast period for fast_hold and every period after that
+static double switch_wake(double c) {
+    double n = period_ticks(air_config.period);
+    if (!anchored || !air_config.fast) {
+        return floor(c / n) * n;
+    }
+    double f = period_ticks(air_config.fast);
+    double span = floor((double)air_config.fast_hold / air_config.fast) * f;
+    double d = c - anchor;
+    if (d < span) {
+        return anchor + floor(d / f) * f;
+    }
+    return anchor + span + floor((d - span) / n) * n;
+}
+
+// how many times it has woken up by tick c, on the same schedule
+static long switch_wakes(double c) {
+    double n = period_ticks(air_config.period);
+    if (!anchored || !air_config.fast) {
+        return (long)floor(c / n);
+    }
+    double f = period_ticks(air_config.fast);
+    double span = floor((double)air_config.fast_hold / air_config.fast) * f;
+    double d = c - anchor;
+    if (d < span) {
+        return anchor_wakes + (long)floor(d / f);
+    }
+    return anchor_wakes + (long)(span / f) + (long)floor((d - span) / n);
+}
+
+// returns 1 if the scripted switch acknowledges the packet, and fills
+// in the ACK: its clock at the wake-up, 4 bytes little-endian, then the
+// channel it moved to if it did and its rate if it has one
+int air_transmit(const air_packet_t *pkt, air_packet_t *ack) {
+    if (current_press < 0) {
+        return 0;
+    }
+    struct press *p = &presses[current_press];
+    if (p->packets++ == 0) {
+        p->first = pkt->start;
+        memcpy(p->addr, pkt->addr, 5);
+    } else if (pkt->start - p->start > p->gap) {
+        p->gap = pkt->start - p->start;
+    }
+    p->start = pkt->start;
+    p->last = pkt->end;
+    p->airtime += pkt->end - pkt->start;
+    for (int r = 0; r < 3; r++) {
+        if (pkt->rate == rates[r]) {
+            p->rate = r;
+        }
+    }
+
+    if (pkt->noack || !pkt->crc || p->acked) {
+        return 0;
+    }
+    // the switch hears packets that fit its window after RX settling
+    double wake = switch_wake(switch_ticks(pkt->start));
+    sim_time_t w = switch_time(wake);
+    long wakes = switch_wakes(wake);
+    int channel = air_config.moved_to ? air_config.moved_to : air_config.home;
+    int rate = air_config.rate >= 0 ? air_config.rate : air_config.home_rate;
+    int away = channel != air_config.home || rate != air_config.home_rate;
+    if (air_config.hopping) {
+        channel = channel_list[hop_sequence[wakes % 16]];
+    } else if (away && pkt->channel == air_config.home && pkt->rate == rates[air_config.home_rate]
+               && wakes % HOME_EVERY == 0) {
+        // away from home every HOME_EVERY-th window is followed by one there
+        channel = air_config.home;
+        rate = air_config.home_rate;
+        w += air_config.window;
+    }
+    sim_time_t window = rate == 0 ? 3 * air_config.window : air_config.window;
+    if (pkt->start < w + 130 * SIM_US || pkt->end > w + window) {
+        return 0;
+    }
+    if (pkt->channel != channel || air_busy(channel, pkt->start, pkt->end)) {
+        return 0;
+    }
+    if (pkt->rate != rates[rate] || pkt->dbm < radio_sensitivity(pkt->rate)) {
+        return 0;
+    }
+    if (lost(-1 - current_press, p->packets)) {
+        return 0;
+    }
+    p->acked = p->packets;
+    p->acked_at = pkt->end;
+    p->channel = channel;
+    anchored = 1;
+    anchor = wake;
+    anchor_wakes = wakes;
+    unsigned long clock = (unsigned long)wake;
+    ack->len = 4;
+    for (int i = 0; i < 4; i++) {
+        ack->payload[i] = clock >> (8 * i);
+    }
+    if (air_config.hopping) {
+        ack->payload[ack->len++] = wakes;
+    } else if (air_config.moved_to || air_config.rate >= 0) {
+        ack->payload[ack->len++] = air_config.moved_to ? air_config.moved_to : air_config.home;
+    }
+    if (air_config.rate >= 0) {
+        ack->payload[ack->len++] = air_config.rate;
+    }
+    return 1;
+}
+
+// a relay pulse started, on = the '1' side
+void air_relay(int on) {
+    latched = on;
+    int i = press_count;
+    while (i > 0 && presses[i - 1].at > sim_now) {
+        i--;
+    }
+    if (i == 0 || sim_now > presses[i - 1].at + SIM_S) {
+        stray_pulses++;
+        return;
+    }
+    struct press *p = &presses[i - 1];
+    p->pulses++;
+    if (!p->relay_at) {
+        p->relay_at = sim_now;
+        p->relay_on = on;
+    }
+    if (on != p->on) {
+        wrong_pulses++;
+    }
+}
+
+// presses the relay was already set for that got no pulse
+unsigned long air_skipped(void) {
+    unsigned long n = 0;
+    for (int i = 0; i < press_count; i++) {
+        n += presses[i].was_set && !presses[i].pulses;
+    }
+    return n;
+}
+
+sim_time_t air_next_event(void) {
+    if (button_down) {
+        return presses[current_press].at + air_config.hold;
+    }
+    if (current_press + 1 < press_count) {
+        return presses[current_press + 1].at;
+    }
+    return SIM_NEVER;
+}
+
+void air_step(void) {
+    if (button_down && sim_now >= presses[current_press].at + air_config.hold) {
+        button_down = 0;
+        sim_sfr.portc.RC2 = 1;
+    }
+    if (current_press + 1 < press_count && sim_now >= presses[current_press + 1].at) {
+        current_press++;
+        struct press *p = &presses[current_press];
+        p->was_set = latched == p->on;
+        p->channel = air_config.hopping ? air_config.home : remote_channel;
+        p->rate = remote_rate;
+        if (air_config.hopping) {
+            // then home through HOP_HOME_EVERY wake-ups and one more
+            p->stop = p->length = air_config.burst
+                    + (HOP_HOME_EVERY + 1) * air_config.period / air_config.spacing;
+        } else if (remote_channel != air_config.home || remote_rate != air_config.home_rate) {
+            p->stop = p->length = 2 * air_config.burst; // then home
+        }
+        button_down = 1;
+        sim_sfr.portc.RC2 = 0;
+    }
+}
+
+void air_report(void) {
+    if (wrong_pulses) {
+        printf("relay pulses against the last press: %lu\n", wrong_pulses);
+    }
+    if (stray_pulses) {
+        printf("relay pulses with no press in the last second: %lu\n", stray_pulses);
+    }
+    for (int i = 0; i < press_count; i++) {
+        const struct press *p = &presses[i];
+        printf("press %d at %.3f s (%s)", i, p->at / 1e9, p->on ? "on" : "off");
+        if (p->channel && p->channel != air_config.home) {
+            printf(" on channel %d", p->channel);
+        }
+        // switch build: what the scripted remote put on air until it stopped
+        sim_time_t airtime = p->airtime;
+        if (!p->packets) {
+            unsigned long first = p->stop < air_config.burst ? p->stop : air_config.burst;
+            airtime = first * remote_airtime(p->rate)
+                      + (p->stop - first) * remote_airtime(air_config.home_rate);
+        }
+        printf(" at %s, %.3f ms on air", rate_names[p->rate], airtime / 1e6);
+        if (p->packets) {
+            printf(": %lu packets to \"%.5s\" over %.3f ms",
+                   p->packets, (const char *)p->addr, (p->last - p->first) / 1e6);
+            if (!p->acked) {
+                printf(" at most %.0f us apart", p->gap / 1e3);
+            }
+        }
+        if (p->acked) {
+            printf(", acked at packet %lu after %.3f ms", p->acked, (p->acked_at - p->at) / 1e6);
+        }
+        if (p->relay_at) {
+            printf(", relay %s after %.3f ms%s, %lu pulse%s", p->relay_on ? "on" : "off",
+                   (p->relay_at - p->at) / 1e6, p->relay_on != p->on ? " (WRONG)" : "",
+                   p->pulses, p->pulses == 1 ? "" : "s");
+        }
+        if (p->was_set && !p->pulses) {
+            printf(", relay already %s", p->on ? "on" : "off");
+        }
+        if (p->stop < p->length) {
+            printf(": remote stopped at packet %lu (%.3f ms) on ACK",
+                   p->stop, (packet_start(i, p->stop) - p->at) / 1e6);
+        }
+        printf("\n");
+    }
+}
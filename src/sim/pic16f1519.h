@@ -0,0 +1,291 @@
+/*
+ * File:   pic16f1519.h
+ *
+ * Host stand-in for the XC8 device header. Only the special function
+ * registers and bits that transceiver.c touches are modelled. Registers
+ * with side effects (SSPBUF, SSPSTAT, LATE, INTCON, PMCON2, ADCON0,
+ * FVRCON, TXSTA, TXREG) and the input ports the firmware polls (PORTB, PORTC)
+ * go through accessor functions in sim.c so the simulator can see every
+ * access.
+ */
+
+#ifndef SIM_PIC16F1519_H
+#define SIM_PIC16F1519_H
+
+#define SIM_BITS8(p) \
+    struct { unsigned p##0:1, p##1:1, p##2:1, p##3:1, \
+                      p##4:1, p##5:1, p##6:1, p##7:1; }
+
+typedef union { unsigned char reg; SIM_BITS8(LATA); } sim_lata_t;
+typedef union { unsigned char reg; SIM_BITS8(LATB); } sim_latb_t;
+typedef union { unsigned char reg; SIM_BITS8(LATC); } sim_latc_t;
+typedef union { unsigned char reg; SIM_BITS8(LATD); } sim_latd_t;
+typedef union { unsigned char reg; SIM_BITS8(LATE); } sim_late_t;
+
+typedef union { unsigned char reg; SIM_BITS8(RA); } sim_porta_t;
+typedef union { unsigned char reg; SIM_BITS8(RB); } sim_portb_t;
+typedef union { unsigned char reg; SIM_BITS8(RC); } sim_portc_t;
+typedef union { unsigned char reg; SIM_BITS8(RD); } sim_portd_t;
+typedef union { unsigned char reg; SIM_BITS8(RE); } sim_porte_t;
+
+typedef union { unsigned char reg; SIM_BITS8(TRISA); } sim_trisa_t;
+typedef union { unsigned char reg; SIM_BITS8(TRISB); } sim_trisb_t;
+typedef union { unsigned char reg; SIM_BITS8(TRISC); } sim_trisc_t;
+typedef union { unsigned char reg; SIM_BITS8(TRISD); } sim_trisd_t;
+typedef union { unsigned char reg; SIM_BITS8(TRISE); } sim_trise_t;
+
+typedef union { unsigned char reg; SIM_BITS8(ANSA); } sim_ansela_t;
+typedef union { unsigned char reg; SIM_BITS8(ANSB); } sim_anselb_t;
+typedef union { unsigned char reg; SIM_BITS8(ANSC); } sim_anselc_t;
+typedef union { unsigned char reg; SIM_BITS8(ANSD); } sim_anseld_t;
+typedef union { unsigned char reg; SIM_BITS8(ANSE); } sim_ansele_t;
+
+typedef union { unsigned char reg; SIM_BITS8(IOCBP); } sim_iocbp_t;
+typedef union { unsigned char reg; SIM_BITS8(IOCBN); } sim_iocbn_t;
+typedef union { unsigned char reg; SIM_BITS8(IOCBF); } sim_iocbf_t;
+
+typedef union {
+    unsigned char reg;
+    struct { unsigned IOCIF:1, INTF:1, TMR0IF:1, IOCIE:1,
+                      INTE:1, TMR0IE:1, PEIE:1, GIE:1; };
+} sim_intcon_t;
+
+typedef union {
+    unsigned char reg;
+    struct { unsigned TMR1IE:1, TMR2IE:1, CCP1IE:1, SSPIE:1,
+                      TXIE:1, RCIE:1, ADIE:1, TMR1GIE:1; };
+} sim_pie1_t;
+
+typedef union {
+    unsigned char reg;
+    struct { unsigned TMR1IF:1, TMR2IF:1, CCP1IF:1, SSPIF:1,
+                      TXIF:1, RCIF:1, ADIF:1, TMR1GIF:1; };
+} sim_pir1_t;
+
+typedef union {
+    unsigned char reg;
+    struct { unsigned TMR1ON:1, :1, nT1SYNC:1, T1OSCEN:1,
+                      T1CKPS:2, TMR1CS:2; };
+    struct { unsigned :4, T1CKPS0:1, T1CKPS1:1, TMR1CS0:1, TMR1CS1:1; };
+} sim_t1con_t;
+
+typedef union {
+    unsigned char reg;
+    struct { unsigned SSPM:4, CKP:1, SSPEN:1, SSPOV:1, WCOL:1; };
+} sim_sspcon1_t;
+
+typedef union {
+    unsigned char reg;
+    struct { unsigned BF:1, UA:1, R_nW:1, S:1, P:1, D_nA:1, CKE:1, SMP:1; };
+} sim_sspstat_t;
+
+typedef union {
+    unsigned char reg;
+    struct { unsigned SCS:2, :1, IRCF:4, SPLLEN:1; };
+} sim_osccon_t;
+
+typedef union {
+    unsigned char reg;
+    struct { unsigned HFIOFS:1, LFIOFR:1, MFIOFR:1, HFIOFL:1, HFIOFR:1, OSTS:1, PLLR:1, T1OSCR:1; };
+} sim_oscstat_t;
+
+typedef union {
+    unsigned char reg;
+    struct { unsigned PS:3, PSA:1, TMR0SE:1, TMR0CS:1, INTEDG:1, nWPUEN:1; };
+} sim_option_reg_t;
+
+typedef union {
+    unsigned char reg;
+    struct { unsigned RD:1, WR:1, WREN:1, WRERR:1, FREE:1, LWLO:1, CFGS:1, :1; };
+} sim_pmcon1_t;
+
+typedef union {
+    unsigned char reg;
+    struct { unsigned ADON:1, GO_nDONE:1, CHS:5, :1; };
+} sim_adcon0_t;
+
+typedef union {
+    unsigned char reg;
+    struct { unsigned ADPREF:2, ADNREF:1, :1, ADCS:3, ADFM:1; };
+} sim_adcon1_t;
+
+typedef union {
+    unsigned char reg;
+    struct { unsigned ADFVR:2, CDAFVR:2, TSRNG:1, TSEN:1, FVRRDY:1, FVREN:1; };
+} sim_fvrcon_t;
+
+typedef union {
+    unsigned char reg;
+    struct { unsigned TX9D:1, TRMT:1, BRGH:1, SENDB:1, SYNC:1, TXEN:1, TX9:1, CSRC:1; };
+} sim_txsta_t;
+
+typedef union {
+    unsigned char reg;
+    struct { unsigned RX9D:1, OERR:1, FERR:1, ADDEN:1, CREN:1, SREN:1, RX9:1, SPEN:1; };
+} sim_rcsta_t;
+
+typedef union {
+    unsigned char reg;
+    struct { unsigned ABDEN:1, WUE:1, :1, BRG16:1, SCKP:1, :1, RCIDL:1, ABDOVF:1; };
+} sim_baudcon_t;
+
+typedef struct {
+    sim_lata_t lata; sim_latb_t latb; sim_latc_t latc; sim_latd_t latd;
+    sim_late_t late;
+    sim_porta_t porta; sim_portb_t portb; sim_portc_t portc;
+    sim_portd_t portd; sim_porte_t porte;
+    sim_trisa_t trisa; sim_trisb_t trisb; sim_trisc_t trisc;
+    sim_trisd_t trisd; sim_trise_t trise;
+    sim_ansela_t ansela; sim_anselb_t anselb; sim_anselc_t anselc;
+    sim_anseld_t anseld; sim_ansele_t ansele;
+    sim_iocbp_t iocbp; sim_iocbn_t iocbn; sim_iocbf_t iocbf;
+    sim_intcon_t intcon;
+    unsigned char tmr0;
+    sim_pie1_t pie1;
+    sim_pir1_t pir1;
+    sim_t1con_t t1con;
+    unsigned char tmr1h, tmr1l;
+    sim_sspcon1_t sspcon1;
+    sim_sspstat_t sspstat;
+    unsigned char sspadd;
+    sim_osccon_t osccon;
+    sim_oscstat_t oscstat;
+    sim_option_reg_t option_reg;
+    sim_pmcon1_t pmcon1;
+    unsigned char pmcon2;
+    unsigned char pmadrl, pmadrh, pmdatl, pmdath;
+    sim_adcon0_t adcon0;
+    sim_adcon1_t adcon1;
+    unsigned char adresh, adresl;
+    sim_fvrcon_t fvrcon;
+    unsigned char wpub;
+    sim_txsta_t txsta;
+    sim_rcsta_t rcsta;
+    sim_baudcon_t baudcon;
+    unsigned char spbrgl, spbrgh, txreg;
+} sim_sfr_t;
+
+extern volatile sim_sfr_t sim_sfr;
+
+volatile sim_late_t *sim_late(void);
+volatile sim_portb_t *sim_portb(void);
+volatile sim_portc_t *sim_portc(void);
+volatile sim_intcon_t *sim_intcon(void);
+volatile sim_iocbf_t *sim_iocbf(void);
+volatile sim_pir1_t *sim_pir1(void);
+volatile unsigned char *sim_sspbuf(void);
+volatile sim_sspstat_t *sim_sspstat(void);
+volatile unsigned char *sim_pmcon2(void);
+volatile sim_adcon0_t *sim_adcon0(void);
+volatile sim_fvrcon_t *sim_fvrcon(void);
+volatile sim_oscstat_t *sim_oscstat(void);
+volatile sim_txsta_t *sim_txsta(void);
+volatile unsigned char *sim_txreg(void);
+
+#define LATA        sim_sfr.lata.reg
+#define LATAbits    sim_sfr.lata
+#define LATB        sim_sfr.latb.reg
+#define LATBbits    sim_sfr.latb
+#define LATC        sim_sfr.latc.reg
+#define LATCbits    sim_sfr.latc
+#define LATD        sim_sfr.latd.reg
+#define LATDbits    sim_sfr.latd
+#define LATE        (sim_late()->reg)
+#define LATEbits    (*sim_late())
+
+#define PORTA       sim_sfr.porta.reg
+#define PORTAbits   sim_sfr.porta
+#define PORTB       (sim_portb()->reg)
+#define PORTBbits   (*sim_portb())
+#define PORTC       (sim_portc()->reg)
+#define PORTCbits   (*sim_portc())
+#define PORTD       sim_sfr.portd.reg
+#define PORTDbits   sim_sfr.portd
+#define PORTE       sim_sfr.porte.reg
+#define PORTEbits   sim_sfr.porte
+
+#define TRISA       sim_sfr.trisa.reg
+#define TRISAbits   sim_sfr.trisa
+#define TRISB       sim_sfr.trisb.reg
+#define TRISBbits   sim_sfr.trisb
+#define TRISC       sim_sfr.trisc.reg
+#define TRISCbits   sim_sfr.trisc
+#define TRISD       sim_sfr.trisd.reg
+#define TRISDbits   sim_sfr.trisd
+#define TRISE       sim_sfr.trise.reg
+#define TRISEbits   sim_sfr.trise
+
+#define ANSELA      sim_sfr.ansela.reg
+#define ANSELAbits  sim_sfr.ansela
+#define ANSELB      sim_sfr.anselb.reg
+#define ANSELBbits  sim_sfr.anselb
+#define ANSELC      sim_sfr.anselc.reg
+#define ANSELCbits  sim_sfr.anselc
+#define ANSELD      sim_sfr.anseld.reg
+#define ANSELDbits  sim_sfr.anseld
+#define ANSELE      sim_sfr.ansele.reg
+#define ANSELEbits  sim_sfr.ansele
+
+#define IOCBP       sim_sfr.iocbp.reg
+#define IOCBPbits   sim_sfr.iocbp
+#define IOCBN       sim_sfr.iocbn.reg
+#define IOCBNbits   sim_sfr.iocbn
+#define IOCBF       (sim_iocbf()->reg)
+#define IOCBFbits   (*sim_iocbf())
+
+#define INTCON      (sim_intcon()->reg)
+#define INTCONbits  (*sim_intcon())
+#define TMR0        sim_sfr.tmr0
+#define PIE1        sim_sfr.pie1.reg
+#define PIE1bits    sim_sfr.pie1
+#define PIR1        (sim_pir1()->reg)
+#define PIR1bits    (*sim_pir1())
+
+#define T1CON       sim_sfr.t1con.reg
+#define T1CONbits   sim_sfr.t1con
+#define TMR1H       sim_sfr.tmr1h
+#define TMR1L       sim_sfr.tmr1l
+
+#define SSPCON1     sim_sfr.sspcon1.reg
+#define SSPCON1bits sim_sfr.sspcon1
+#define SSPSTAT     (sim_sspstat()->reg)
+#define SSPSTATbits (*sim_sspstat())
+#define SSPBUF      (*sim_sspbuf())
+#define SSPADD      sim_sfr.sspadd
+
+#define OSCCON      sim_sfr.osccon.reg
+#define OSCCONbits  sim_sfr.osccon
+#define OSCSTAT     (sim_oscstat()->reg)
+#define OSCSTATbits (*sim_oscstat())
+#define OPTION_REG  sim_sfr.option_reg.reg
+#define OPTION_REGbits sim_sfr.option_reg
+
+#define PMCON1      sim_sfr.pmcon1.reg
+#define PMCON1bits  sim_sfr.pmcon1
+#define PMCON2      (*sim_pmcon2())
+#define PMADRL      sim_sfr.pmadrl
+#define PMADRH      sim_sfr.pmadrh
+#define PMDATL      sim_sfr.pmdatl
+#define PMDATH      sim_sfr.pmdath
+
+#define ADCON0      (sim_adcon0()->reg)
+#define ADCON0bits  (*sim_adcon0())
+#define ADCON1      sim_sfr.adcon1.reg
+#define ADCON1bits  sim_sfr.adcon1
+#define ADRESH      sim_sfr.adresh
+#define ADRESL      sim_sfr.adresl
+#define FVRCON      (sim_fvrcon()->reg)
+#define FVRCONbits  (*sim_fvrcon())
+
+#define WPUB        sim_sfr.wpub
+#define TXSTA       (sim_txsta()->reg)
+#define TXSTAbits   (*sim_txsta())
+#define RCSTA       sim_sfr.rcsta.reg
+#define RCSTAbits   sim_sfr.rcsta
+#define BAUDCON     sim_sfr.baudcon.reg
+#define BAUDCONbits sim_sfr.baudcon
+#define SPBRGL      sim_sfr.spbrgl
+#define SPBRGH      sim_sfr.spbrgh
+#define TXREG       (*sim_txreg())
+
+#endif
@@ -0,0 +1,606 @@
+/*
+ * File:   radio.c
+ *
+ * nRF24L01 model: register file, SPI command decoder, 3-deep TX/RX FIFOs
+ * and the radio state machine with the settling and start-up times from
+ * the datasheet. Packets go to and come from air.c.
+ */
+
+#include <string.h>
+#include "sim.h"
+
+#define REG_CONFIG      0x00
+#define REG_EN_AA       0x01
+#define REG_EN_RXADDR   0x02
+#define REG_SETUP_AW    0x03
+#define REG_SETUP_RETR  0x04
+#define REG_RF_CH       0x05
+#define REG_RF_SETUP    0x06
+#define REG_STATUS      0x07
+#define REG_OBSERVE_TX  0x08
+#define REG_RPD         0x09
+#define REG_RX_ADDR_P0  0x0A
+#define REG_RX_ADDR_P1  0x0B
+#define REG_TX_ADDR     0x10
+#define REG_RX_PW_P0    0x11
+#define REG_FIFO_STATUS 0x17
+#define REG_DYNPD       0x1C
+#define REG_FEATURE     0x1D
+
+#define T_SETTLE  (130 * SIM_US)
+#define T_PD2STBY (1500 * SIM_US)
+#define T_TX_MAX  (4 * SIM_MS) // longest the PLL may stay in TX mode
+
+struct fifo_entry {
+    unsigned char len;
+    unsigned char pipe;
+    unsigned char noack;
+    unsigned char data[32];
+};
+
+struct fifo {
+    struct fifo_entry e[3];
+    int count;
+};
+
+struct radio_stats radio_stats;
+
+static unsigned char regs[0x20];
+static unsigned char addr_p0[5], addr_p1[5], addr_tx[5];
+static struct fifo rx_fifo, tx_fifo;
+static int tx_reuse;
+
+static enum radio_state state;
+static sim_time_t state_until;
+static sim_time_t rx_since;
+static sim_time_t rx_entered;
+static unsigned char rpd; // latched when RX ends...
+static int rpd_packet; // ...or on a valid packet, until CE goes up again
+static air_packet_t on_air;
+static sim_time_t tx_since; // TX mode entered, packets back to back since
+static air_packet_t ack_in; // what the other end put in its ACK
+static int acked;
+static int retries;
+static int ack_payload; // PRX: the ACK going out carries a payload
+
+static int pin_csn = 1, pin_ce = 0;
+static unsigned char cmd;
+static int cmd_pos;
+static struct fifo_entry pending; // payload being clocked in over SPI
+
+static void fifo_push(struct fifo *f, const struct fifo_entry *e) {
+    if (f->count < 3) {
+        f->e[f->count++] = *e;
+    }
+}
+
+static void fifo_pop(struct fifo *f) {
+    if (f->count > 0) {
+        memmove(&f->e[0], &f->e[1], sizeof(f->e[0]) * 2);
+        f->count--;
+    }
+}
+
+static unsigned char status_reg(void) {
+    unsigned char s = regs[REG_STATUS] & 0x70;
+    s |= (rx_fifo.count ? rx_fifo.e[0].pipe : 7) << 1;
+    if (tx_fifo.count == 3) {
+        s |= 0x01;
+    }
+    return s;
+}
+
+static unsigned char fifo_status_reg(void) {
+    unsigned char s = 0;
+    if (tx_reuse)            s |= 0x40;
+    if (tx_fifo.count == 3)  s |= 0x20;
+    if (tx_fifo.count == 0)  s |= 0x10;
+    if (rx_fifo.count == 3)  s |= 0x02;
+    if (rx_fifo.count == 0)  s |= 0x01;
+    return s;
+}
+
+static int address_width(void) {
+    int aw = (regs[REG_SETUP_AW] & 0x03) + 2;
+    return aw < 3 ? 3 : aw;
+}
+
+static int data_rate(void) {
+    if (regs[REG_RF_SETUP] & 0x20) {
+        return RATE_250K;
+    }
+    return (regs[REG_RF_SETUP] & 0x08) ? RATE_2M : RATE_1M;
+}
+
+static int crc_length(void) {
+    // auto-ack on any pipe forces CRC on
+    if (!(regs[REG_CONFIG] & 0x08) && !regs[REG_EN_AA]) {
+        return 0;
+    }
+    return (regs[REG_CONFIG] & 0x04) ? 2 : 1;
+}
+
+// DPL_Px needs ENAA_Px as well
+static int dynamic_payload(int pipe) {
+    return (regs[REG_FEATURE] & 0x04) && (regs[REG_DYNPD] & regs[REG_EN_AA] & (1 << pipe));
+}
+
+static unsigned char *reg_bytes(unsigned char reg, int *len) {
+    *len = 1;
+    switch (reg) {
+        case REG_RX_ADDR_P0: *len = 5; return addr_p0;
+        case REG_RX_ADDR_P1: *len = 5; return addr_p1;
+        case REG_TX_ADDR:    *len = 5; return addr_tx;
+        default:             return &regs[reg];
+    }
+}
+
+sim_time_t radio_airtime(const air_packet_t *pkt) {
+    unsigned long bits = 8UL * (1 + pkt->aw + pkt->len + pkt->crc);
+    if (pkt->pcf) {
+        bits += 9;
+    }
+    switch (pkt->rate) {
+        case RATE_2M:   return bits * SIM_US / 2;
+        case RATE_250K: return bits * SIM_US * 4;
+        default:        return bits * SIM_US;
+    }
+}
+
+// RPD: a carrier over -64 dBm for 40 us since RX started, or a packet
+// that has been on air that long and still is
+static unsigned char carrier(void) {
+    int channel = regs[REG_RF_CH] & 0x7F;
+    if (air_busy(channel, rx_entered, sim_now) >= 40 * SIM_US) {
+        return 1;
+    }
+    air_packet_t pkt;
+    sim_time_t since = sim_now - 40 * SIM_US;
+    return sim_now >= rx_entered + 40 * SIM_US
+           && air_next(sim_now > 2 * SIM_MS ? sim_now - 2 * SIM_MS : 0, sim_now, &pkt)
+           && pkt.start <= since && pkt.channel == channel && pkt.dbm > -64;
+}
+
+static void enter(enum radio_state s, sim_time_t duration) {
+    if (state == RADIO_RX && s != RADIO_RX && !rpd_packet) {
+        rpd = carrier();
+    }
+    state = s;
+    state_until = duration ? sim_now + duration : SIM_NEVER;
+    if (s == RADIO_RX) {
+        rx_since = rx_entered = sim_now;
+        if (!rpd_packet) {
+            rpd = 0;
+        }
+    }
+}
+
+// packet format of this radio, addressed to pipe 0
+void radio_air_format(air_packet_t *pkt) {
+    pkt->channel = regs[REG_RF_CH] & 0x7F;
+    pkt->rate = data_rate();
+    pkt->aw = address_width();
+    memcpy(pkt->addr, (regs[REG_CONFIG] & 0x01) ? addr_p0 : addr_tx, 5);
+    pkt->crc = crc_length();
+    pkt->pcf = regs[REG_EN_AA] || (regs[REG_FEATURE] & 0x04);
+    pkt->noack = !(regs[REG_EN_AA] & 0x01);
+    pkt->crc_ok = 1;
+    pkt->burst = -1;
+    pkt->dbm = air_config.dbm;
+}
+
+static sim_time_t ack_airtime(int len) {
+    air_packet_t ack;
+    memset(&ack, 0, sizeof(ack));
+    radio_air_format(&ack);
+    ack.pcf = 1;
+    ack.len = len;
+    return radio_airtime(&ack);
+}
+
+static int ack_payloads(void) {
+    return (regs[REG_FEATURE] & 0x02) && dynamic_payload(0);
+}
+
+static void start_tx(void) {
+    const struct fifo_entry *e = &tx_fifo.e[0];
+    memset(&on_air, 0, sizeof(on_air));
+    radio_air_format(&on_air);
+    on_air.len = e->len;
+    memcpy(on_air.payload, e->data, e->len);
+    on_air.noack |= e->noack;
+    on_air.start = sim_now;
+    on_air.end = sim_now + radio_airtime(&on_air);
+    enter(RADIO_TX, on_air.end - sim_now);
+}
+
+// settle the state machine after a pin, register or FIFO change
+static void update(void) {
+    int pwr_up = regs[REG_CONFIG] & 0x02;
+    int prim_rx = regs[REG_CONFIG] & 0x01;
+
+    if (!pwr_up) {
+        if (state != RADIO_PWR_DOWN) {
+            enter(RADIO_PWR_DOWN, 0);
+        }
+        return;
+    }
+    switch (state) {
+        case RADIO_PWR_DOWN:
+            enter(RADIO_STARTUP, T_PD2STBY);
+            break;
+        case RADIO_STANDBY_I:
+            if (pin_ce && prim_rx) {
+                enter(RADIO_RX_SETTLE, T_SETTLE);
+            } else if (pin_ce && tx_fifo.count && !(regs[REG_STATUS] & 0x10)) {
+                enter(RADIO_TX_SETTLE, T_SETTLE);
+            } else if (pin_ce) {
+                enter(RADIO_STANDBY_II, 0);
+            }
+            break;
+        case RADIO_STANDBY_II:
+            if (!pin_ce) {
+                enter(RADIO_STANDBY_I, 0);
+            } else if (tx_fifo.count && !(regs[REG_STATUS] & 0x10)) {
+                enter(RADIO_TX_SETTLE, T_SETTLE);
+            }
+            break;
+        case RADIO_RX_SETTLE:
+        case RADIO_RX:
+            if (!pin_ce || !prim_rx) {
+                enter(RADIO_STANDBY_I, 0);
+            }
+            break;
+        default:
+            // start-up and transmissions run to completion
+            break;
+    }
+}
+
+static int pipe_match(const air_packet_t *pkt) {
+    int aw = address_width();
+    if (pkt->aw != aw) {
+        return -1;
+    }
+    for (int pipe = 0; pipe < 6; pipe++) {
+        if (!(regs[REG_EN_RXADDR] & (1 << pipe))) {
+            continue;
+        }
+        const unsigned char *a = pipe == 0 ? addr_p0 : addr_p1;
+        if (pipe >= 2) {
+            if (pkt->addr[0] != regs[REG_RX_ADDR_P0 + pipe]) {
+                continue;
+            }
+            if (memcmp(pkt->addr + 1, a + 1, aw - 1) == 0) {
+                return pipe;
+            }
+        } else if (memcmp(pkt->addr, a, aw) == 0) {
+            return pipe;
+        }
+    }
+    return -1;
+}
+
+int radio_sensitivity(int rate) {
+    static const int dbm[3] = { -85, -82, -94 }; // 1M, 2M, 250k
+    return dbm[rate];
+}
+
+int radio_pipe_width(int pipe) {
+    return regs[REG_RX_PW_P0 + pipe] & 0x3F;
+}
+
+static void receive(const air_packet_t *pkt) {
+    if (pkt->channel != (regs[REG_RF_CH] & 0x7F) || pkt->rate != data_rate()) {
+        return;
+    }
+    if (pkt->dbm < radio_sensitivity(pkt->rate)) {
+        return;
+    }
+    if (pkt->crc != crc_length() || (pkt->crc && !pkt->crc_ok)) {
+        return;
+    }
+    int pipe = pipe_match(pkt);
+    if (pipe < 0) {
+        return;
+    }
+    struct fifo_entry e;
+    memset(&e, 0xFF, sizeof(e));
+    e.pipe = pipe;
+    if (dynamic_payload(pipe)) {
+        e.len = pkt->len;
+    } else {
+        // without CRC a width mismatch is clocked in as garbage
+        e.len = regs[REG_RX_PW_P0 + pipe] & 0x3F;
+        if (e.len == 0) {
+            return;
+        }
+    }
+    memcpy(e.data, pkt->payload, e.len < pkt->len ? e.len : pkt->len);
+    if (rx_fifo.count == 3) {
+        radio_stats.rx_overflow++;
+        return;
+    }
+    fifo_push(&rx_fifo, &e);
+    rpd = pkt->dbm > -64;
+    rpd_packet = 1;
+    regs[REG_STATUS] |= 0x40; // RX_DR
+    radio_stats.rx_packets++;
+    if (pkt->pcf && !pkt->noack && (regs[REG_EN_AA] & (1 << pipe))) {
+        radio_stats.acks_sent++;
+        // an ACK payload loaded for this pipe rides along
+        int len = 0;
+        ack_payload = 0;
+        if (ack_payloads() && tx_fifo.count && tx_fifo.e[0].pipe == pipe) {
+            ack_payload = 1;
+            len = tx_fifo.e[0].len;
+            air_ack(pkt, tx_fifo.e[0].data, len);
+            fifo_pop(&tx_fifo);
+        } else {
+            air_ack(pkt, 0, 0);
+        }
+        enter(RADIO_ACK, T_SETTLE + ack_airtime(len));
+    }
+}
+
+void radio_reset(void) {
+    static const unsigned char defaults[0x20] = {
+        0x08, 0x3F, 0x03, 0x03, 0x03, 0x02, 0x0F, 0x0E,
+        0x00, 0x00, 0x00, 0x00, 0xC3, 0xC4, 0xC5, 0xC6,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x11,
+    };
+    memcpy(regs, defaults, sizeof(regs));
+    memset(addr_p0, 0xE7, 5);
+    memset(addr_p1, 0xC2, 5);
+    memset(addr_tx, 0xE7, 5);
+    memset(&rx_fifo, 0, sizeof(rx_fifo));
+    memset(&tx_fifo, 0, sizeof(tx_fifo));
+    memset(&pending, 0, sizeof(pending));
+    memset(&radio_stats, 0, sizeof(radio_stats));
+    tx_reuse = 0;
+    rpd = 0;
+    rpd_packet = 0;
+    acked = 0;
+    retries = 0;
+    ack_payload = 0;
+    pin_csn = 1;
+    pin_ce = 0;
+    cmd_pos = 0;
+    // the firmware starts talking to the module 100 ms after power on
+    enter(RADIO_PWR_DOWN, 0);
+}
+
+// called on every CSN rising edge: commands that move data commit here
+static void end_command(void) {
+    if (cmd_pos == 0) {
+        return;
+    }
+    if (cmd == 0xA0 || cmd == 0xB0 || (cmd & 0xF8) == 0xA8) { // W_TX_PAYLOAD(_NOACK), W_ACK_PAYLOAD
+        pending.noack = cmd == 0xB0;
+        pending.pipe = (cmd & 0xF8) == 0xA8 ? cmd & 0x07 : 0;
+        if (pending.len) {
+            fifo_push(&tx_fifo, &pending);
+            tx_reuse = 0;
+        }
+    } else if (cmd == 0x61 && cmd_pos > 1) { // R_RX_PAYLOAD
+        fifo_pop(&rx_fifo);
+    }
+    cmd_pos = 0;
+    update();
+}
+
+void radio_pins(int csn, int ce) {
+    if (csn != pin_csn) {
+        pin_csn = csn;
+        if (csn) {
+            end_command();
+        } else {
+            cmd_pos = 0;
+        }
+    }
+    if (ce != pin_ce) {
+        pin_ce = ce;
+        if (ce) {
+            rpd_packet = 0;
+        }
+        update();
+    }
+}
+
+unsigned char radio_spi(unsigned char mosi) {
+    if (pin_csn) {
+        return 0xFF; // MISO is tri-stated
+    }
+    if (cmd_pos++ == 0) {
+        cmd = mosi;
+        pending.len = 0;
+        switch (cmd) {
+            case 0xE1: // FLUSH_TX
+                tx_fifo.count = 0;
+                tx_reuse = 0;
+                break;
+            case 0xE2: // FLUSH_RX
+                rx_fifo.count = 0;
+                break;
+            case 0xE3: // REUSE_TX_PL
+                tx_reuse = 1;
+                break;
+        }
+        return status_reg();
+    }
+
+    int i = cmd_pos - 2;
+    if (cmd < 0x20) { // R_REGISTER
+        int len;
+        unsigned char reg = cmd & 0x1F;
+        if (reg == REG_STATUS) return status_reg();
+        if (reg == REG_OBSERVE_TX) return regs[REG_OBSERVE_TX];
+        if (reg == REG_FIFO_STATUS) return fifo_status_reg();
+        if (reg == REG_RPD) return state == RADIO_RX && !rpd_packet ? carrier() : rpd;
+        unsigned char *p = reg_bytes(reg, &len);
+        return i < len ? p[i] : 0x00;
+    }
+    if (cmd < 0x40) { // W_REGISTER
+        int len;
+        unsigned char reg = cmd & 0x1F;
+        if (reg == REG_STATUS) {
+            regs[REG_STATUS] &= ~(mosi & 0x70); // write 1 to clear
+        } else if (reg != REG_FIFO_STATUS && reg != REG_RPD && reg != REG_OBSERVE_TX) {
+            unsigned char *p = reg_bytes(reg, &len);
+            if (i < len) {
+                p[i] = mosi;
+            }
+        }
+        update();
+        return 0x00;
+    }
+    switch (cmd) {
+        case 0x61: // R_RX_PAYLOAD
+            return (rx_fifo.count && i < 32) ? rx_fifo.e[0].data[i] : 0x00;
+        case 0x60: // R_RX_PL_WID
+            return rx_fifo.count ? rx_fifo.e[0].len : 0x00;
+        case 0xA0: // W_TX_PAYLOAD
+        case 0xB0: // W_TX_PAYLOAD_NOACK
+        case 0xA8: case 0xA9: case 0xAA: case 0xAB: case 0xAC: case 0xAD: // W_ACK_PAYLOAD
+            if (pending.len < 32) {
+                pending.data[pending.len++] = mosi;
+            }
+            return 0x00;
+    }
+    return 0x00;
+}
+
+sim_time_t radio_next_event(void) {
+    sim_time_t next = state_until;
+    if (state == RADIO_RX) {
+        air_packet_t pkt;
+        if (air_next(rx_since, sim_now, &pkt) && pkt.end < next) {
+            next = pkt.end;
+        }
+    }
+    return next;
+}
+
+void radio_step(void) {
+    if (state == RADIO_RX) {
+        air_packet_t pkt;
+        while (state == RADIO_RX && air_next(rx_since, sim_now - 1, &pkt)
+               && pkt.end <= sim_now) {
+            // don't pick the same packet up again
+            rx_since = pkt.start + 1;
+            receive(&pkt);
+        }
+    }
+    if (sim_now < state_until) {
+        return;
+    }
+    switch (state) {
+        case RADIO_STARTUP:
+            enter(RADIO_STANDBY_I, 0);
+            break;
+        case RADIO_RX_SETTLE:
+            enter(RADIO_RX, 0);
+            break;
+        case RADIO_TX_SETTLE:
+            if (tx_fifo.count) {
+                tx_since = sim_now;
+                start_tx();
+            } else {
+                enter(RADIO_STANDBY_I, 0);
+            }
+            return;
+        case RADIO_TX:
+            radio_stats.tx_packets++;
+            radio_stats.tx_airtime += on_air.end - on_air.start;
+            memset(&ack_in, 0, sizeof(ack_in));
+            acked = air_transmit(&on_air, &ack_in);
+            if (!on_air.noack) {
+                // wait ARD for the ACK, or less if it shows up
+                sim_time_t ard = ((regs[REG_SETUP_RETR] >> 4) + 1) * 250 * SIM_US;
+                enter(RADIO_WAIT_ACK, acked ? T_SETTLE + ack_airtime(ack_in.len) : ard);
+                return;
+            }
+            regs[REG_STATUS] |= 0x20; // TX_DS
+            if (!tx_reuse) {
+                fifo_pop(&tx_fifo);
+            }
+            if (pin_ce && tx_fifo.count) {
+                // CE still up: the next one goes without settling again
+                if (sim_now - tx_since > T_TX_MAX && on_air.start - tx_since <= T_TX_MAX) {
+                    radio_stats.tx_overlong++;
+                }
+                start_tx();
+                return;
+            }
+            enter(RADIO_STANDBY_I, 0);
+            break;
+        case RADIO_WAIT_ACK:
+            if (acked) {
+                radio_stats.acks_received++;
+                regs[REG_STATUS] |= 0x20; // TX_DS
+                if (ack_in.len && ack_payloads() && rx_fifo.count < 3) {
+                    struct fifo_entry e;
+                    memset(&e, 0, sizeof(e));
+                    e.len = ack_in.len;
+                    memcpy(e.data, ack_in.payload, ack_in.len);
+                    fifo_push(&rx_fifo, &e);
+                    regs[REG_STATUS] |= 0x40; // RX_DR
+                }
+                regs[REG_OBSERVE_TX] = (regs[REG_OBSERVE_TX] & 0xF0) | retries;
+                retries = 0;
+                if (!tx_reuse) {
+                    fifo_pop(&tx_fifo);
+                }
+            } else if (retries < (regs[REG_SETUP_RETR] & 0x0F)) {
+                retries++;
+                start_tx();
+                return;
+            } else {
+                // the payload stays in the TX FIFO
+                regs[REG_STATUS] |= 0x10; // MAX_RT
+                if ((regs[REG_OBSERVE_TX] & 0xF0) != 0xF0) {
+                    regs[REG_OBSERVE_TX] += 0x10; // PLOS_CNT
+                }
+                retries = 0;
+            }
+            enter(RADIO_STANDBY_I, 0);
+            break;
+        case RADIO_ACK:
+            if (ack_payload) {
+                regs[REG_STATUS] |= 0x20; // TX_DS, as on a PTX
+                ack_payload = 0;
+            }
+            enter(RADIO_STANDBY_I, 0);
+            break;
+        default:
+            break;
+    }
+    update();
+}
+
+int radio_irq(void) {
+    unsigned char pending_irq = regs[REG_STATUS] & 0x70 & ~regs[REG_CONFIG];
+    return pending_irq ? 0 : 1; // active low
+}
+
+enum radio_state radio_state(void) {
+    return state;
+}
+
+double radio_current_ua(void) {
+    static const double tx_ua[4] = { 7000, 7500, 9000, 11300 }; // -18..0 dBm
+    static const double rx_ua[3] = { 11800, 12300, 12600 };     // 1M, 2M, 250k
+    switch (state) {
+        case RADIO_PWR_DOWN:   return 0.9;
+        case RADIO_STARTUP:    return 285;
+        case RADIO_STANDBY_I:  return 22;
+        case RADIO_STANDBY_II: return 320;
+        case RADIO_RX_SETTLE:  return 8900;
+        case RADIO_RX:         return rx_ua[data_rate()];
+        case RADIO_TX_SETTLE:  return 8000;
+        case RADIO_TX:
+        case RADIO_ACK:        return tx_ua[(regs[REG_RF_SETUP] >> 1) & 0x03];
+        case RADIO_WAIT_ACK:   return rx_ua[data_rate()];
+    }
+    return 0;
+}
@@ -0,0 +1,967 @@
+/*
+ * File:   sim.c
+ *
+ * Host-side simulator for transceiver.c. Models the PIC16F1519 core
+ * (clock, SLEEP, interrupt dispatch, Timer0, Timer1, MSSP in SPI master mode,
+ * interrupt-on-change, ADC, High-Endurance Flash, EUSART transmit) and the board (relay, doubling capacitor, LED)
+ * and integrates time and battery charge per firmware state.
+ *
+ * Interrupts are taken at the next delay, SPI transfer, SLEEP or
+ * INTCON access, which is where the firmware gives time away or
+ * re-enables them anyway.
+ *
+ * Currents are datasheet typicals at 3 V; adjust them to board
+ * measurements when those exist.
+ */
+
+#include <math.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+
+/* <BOARD PARAMETERS> */
+
+#define MCU_SLEEP_UA      11.0   // PIC16F1519 IPD with LFINTOSC/Timer1
+#define MCU_RUN_UA_BASE   30.0
+#define MCU_RUN_UA_PER_MHZ 110.0
+#define LED_UA            2000.0
+#define CAP_F             2200e-6 // voltage doubling capacitor
+#define CAP_CHARGE_OHM    4.7     // charge path through A0/A2 drivers
+#define RELAY_COIL_OHM    125.0   // 5 V latching relay coil
+#define BATTERY_MAH       2000.0  // two AA cells in series
+#define SPI_CALL_CYCLES   16      // call overhead per polled SPI byte
+#define ISR_CYCLES        12      // interrupt entry, context save and RETFIE
+#define FLASH_WRITE_NS    (2 * SIM_MS) // row erase or word write, CPU stalled
+#define CAP_SENSE_DIVIDER 0.5     // capacitor to RA5/AN4
+#define CAP_SENSE_TAU_S   0.235e-3 // 470k || 470k into the 1 nF on RA5
+#define FVR_UA            15.0    // fixed voltage reference, when enabled
+#define FVR_SETTLE_NS     (25 * SIM_US)
+#define HFINTOSC_START_NS (5 * SIM_US) // HFINTOSC from off to ready
+#define RELAY_OPERATE_V   3.75    // must-operate, 75% of the 5 V coil
+
+/* <STATE> */
+
+enum {
+    ST_SLEEP,
+    ST_ACTIVE,
+    ST_SPI,
+    ST_RX,
+    ST_TX,
+    ST_RELAY,
+    ST_RECHARGE,
+    ST_COUNT
+};
+
+static const char *state_names[ST_COUNT] = {
+    "sleep", "active", "spi", "rx window", "tx", "relay pulse", "recharge"
+};
+
+volatile sim_sfr_t sim_sfr;
+sim_time_t sim_now;
+sim_time_t sim_end = 10 * SIM_S;
+double sim_vbat = 3.0;
+static double vbat_start = 3.0, vbat_end = 3.0; // sags linearly over the run
+
+static jmp_buf sim_exit;
+static int sleeping;
+static int in_isr;
+static int in_spi;
+
+static double state_ns[ST_COUNT];
+static double state_uas[ST_COUNT]; // charge in uA*s
+
+static double cap_v;
+static double sense_v; // RA5, trailing cap_v through the divider
+
+static struct {
+    unsigned long wakeups;
+    unsigned long interrupts;
+    sim_time_t isr_worst;
+    unsigned long timer1_overflows;
+    unsigned long spi_bytes;
+    unsigned long relay_pulses;
+    unsigned long weak_pulses; // started below RELAY_OPERATE_V
+    unsigned long flash_erases, flash_writes;
+    unsigned long resets;
+    // awake time below fosc_top, the fastest clock so far, and the
+    // charge that saved against running it at fosc_top
+    double fosc_top;
+    sim_time_t awake_ns, slow_ns;
+    double slow_saved_uas;
+    // boot: first CE/CSN access, last SPI byte before the firmware
+    // settles into its idle path (first SLEEP or button poll)
+    sim_time_t nrf_first, spi_last, ready_at;
+} counters;
+
+extern void int_handler(void);
+extern void firmware_main(void);
+
+/* <CLOCK> */
+
+double sim_fosc_hz(void) {
+    static const double ircf_hz[16] = {
+        31000, 31000, 31250, 31250, 62500, 125000, 250000, 500000,
+        125000, 250000, 500000, 1e6, 2e6, 4e6, 8e6, 16e6
+    };
+    double f = ircf_hz[sim_sfr.osccon.IRCF];
+    if (sim_sfr.osccon.IRCF == 14 && sim_sfr.osccon.SPLLEN) {
+        f = 32e6;
+    }
+    return f;
+}
+
+static double run_ua(double fosc_hz) {
+    return MCU_RUN_UA_BASE + MCU_RUN_UA_PER_MHZ * fosc_hz / 1e6;
+}
+
+// HFINTOSC feeds IRCF 1000-1111 and is off otherwise, see sim_oscstat()
+static int hf_running;
+
+
+static sim_time_t cycles_ns(unsigned long cycles) {
+    return (sim_time_t)(cycles * 4e9 / sim_fosc_hz());
+}
+
+/* <TIMER0> */
+
+static unsigned t0_count;
+static unsigned t0_written;
+static double t0_phase;
+
+// Timer0 runs on Fosc/4 (or T0CKI, unused here) and stops in sleep
+static double timer0_tick_ns(void) {
+    if (sleeping || sim_sfr.option_reg.TMR0CS) {
+        return 0;
+    }
+    int prescale = sim_sfr.option_reg.PSA ? 1 : 2 << sim_sfr.option_reg.PS;
+    return 4e9 * prescale / sim_fosc_hz();
+}
+
+static void timer0_load(void) {
+    if (sim_sfr.tmr0 != t0_written) {
+        t0_count = sim_sfr.tmr0;
+        t0_phase = 0;
+    }
+}
+
+static void timer0_store(void) {
+    sim_sfr.tmr0 = t0_count;
+    t0_written = t0_count;
+}
+
+static void timer0_run(sim_time_t dt) {
+    double tick = timer0_tick_ns();
+    if (tick == 0) {
+        return;
+    }
+    t0_phase += dt;
+    unsigned long ticks = (unsigned long)(t0_phase / tick + 1e-9);
+    t0_phase -= ticks * tick;
+    if (t0_phase < 0) {
+        t0_phase = 0;
+    }
+    unsigned long count = t0_count + ticks;
+    if (count >= 256) {
+        sim_sfr.intcon.TMR0IF = 1;
+    }
+    t0_count = count & 0xFF;
+}
+
+/* <TIMER1> */
+
+static unsigned t1_count;
+static unsigned t1_written;
+static double t1_phase;
+
+static double timer1_tick_ns(void) {
+    if (!sim_sfr.t1con.TMR1ON) {
+        return 0;
+    }
+    double f;
+    switch (sim_sfr.t1con.TMR1CS) {
+        case 0: f = sim_fosc_hz() / 4; break;
+        case 1: f = sim_fosc_hz(); break;
+        case 2: f = sim_sfr.t1con.T1OSCEN ? 32768 : 0; break;
+        default: f = 31000; break; // LFINTOSC
+    }
+    if (sleeping && (sim_sfr.t1con.TMR1CS < 2 || !sim_sfr.t1con.nT1SYNC)) {
+        return 0; // synchronous clocks stop in sleep
+    }
+    return f ? 1e9 * (1 << sim_sfr.t1con.T1CKPS) / f : 0;
+}
+
+// pick up TMR1H/TMR1L writes made by the firmware
+static void timer1_load(void) {
+    unsigned cur = (sim_sfr.tmr1h << 8) | sim_sfr.tmr1l;
+    if (cur != t1_written) {
+        t1_count = cur;
+        t1_phase = 0;
+    }
+}
+
+static void timer1_store(void) {
+    sim_sfr.tmr1h = t1_count >> 8;
+    sim_sfr.tmr1l = t1_count & 0xFF;
+    t1_written = t1_count;
+}
+
+static sim_time_t timer1_next_event(void) {
+    double tick = timer1_tick_ns();
+    if (tick == 0) {
+        return SIM_NEVER;
+    }
+    double left = (65536 - t1_count) * tick - t1_phase;
+    return sim_now + (sim_time_t)ceil(left > 0 ? left : 0);
+}
+
+static void timer1_run(sim_time_t dt) {
+    double tick = timer1_tick_ns();
+    if (tick == 0) {
+        return;
+    }
+    t1_phase += dt;
+    unsigned long ticks = (unsigned long)(t1_phase / tick + 1e-9);
+    t1_phase -= ticks * tick;
+    if (t1_phase < 0) {
+        t1_phase = 0;
+    }
+    unsigned long count = t1_count + ticks;
+    if (count >= 65536) {
+        sim_sfr.pir1.TMR1IF = 1;
+        counters.timer1_overflows++;
+    }
+    t1_count = count & 0xFFFF;
+}
+
+/* <MSSP> */
+
+static enum { SSP_IDLE, SSP_LOADED, SSP_DONE } ssp_state;
+static unsigned char ssp_tx, ssp_rx;
+static sim_time_t ssp_done_at;
+
+static sim_time_t ssp_byte_ns(void) {
+    static const int div[4] = { 4, 16, 64, 0 };
+    int d = div[sim_sfr.sspcon1.SSPM & 0x03];
+    if (sim_sfr.sspcon1.SSPM == 0x0A) {
+        d = 4 * (sim_sfr.sspadd + 1);
+    }
+    return (sim_time_t)(8 * d * 1e9 / sim_fosc_hz());
+}
+
+/* <DEBUG PIN> */
+
+// -d pulls RB1 low for 10 ms at the given times, a stats dump request
+#define MAX_DUMPS 16
+#define DUMP_LOW_NS (10 * SIM_MS)
+
+static sim_time_t dump_at[MAX_DUMPS];
+static int dump_count, dump_next;
+static int debug_low;
+static sim_time_t debug_high_at;
+
+static void dump_request(sim_time_t at) {
+    if (dump_count == MAX_DUMPS) {
+        return;
+    }
+    int i = dump_count++;
+    while (i > 0 && dump_at[i - 1] > at) {
+        dump_at[i] = dump_at[i - 1];
+        i--;
+    }
+    dump_at[i] = at;
+}
+
+static sim_time_t debug_next_event(void) {
+    if (debug_low) {
+        return debug_high_at;
+    }
+    return dump_next < dump_count ? dump_at[dump_next] : SIM_NEVER;
+}
+
+static void debug_step(void) {
+    if (debug_low && sim_now >= debug_high_at) {
+        debug_low = 0;
+        sim_sfr.portb.RB1 = 1;
+        if (sim_sfr.iocbp.IOCBP1) {
+            sim_sfr.iocbf.IOCBF1 = 1;
+        }
+    }
+    if (!debug_low && dump_next < dump_count && sim_now >= dump_at[dump_next]) {
+        dump_next++;
+        debug_low = 1;
+        debug_high_at = sim_now + DUMP_LOW_NS;
+        sim_sfr.portb.RB1 = 0;
+        if (sim_sfr.iocbn.IOCBN1) {
+            sim_sfr.iocbf.IOCBF1 = 1;
+        }
+    }
+}
+
+/* <PINS> */
+
+static int last_irq = 1;
+static int last_relay;
+
+static void pins_sync(void) {
+    radio_pins(sim_sfr.late.LATE1, sim_sfr.late.LATE2);
+
+    int irq = radio_irq();
+    if (irq != last_irq) {
+        sim_sfr.portb.RB0 = irq;
+        if ((!irq && sim_sfr.iocbn.IOCBN0) || (irq && sim_sfr.iocbp.IOCBP0)) {
+            sim_sfr.iocbf.IOCBF0 = 1;
+        }
+        last_irq = irq;
+    }
+    int relay = sim_sfr.lata.LATA3 || sim_sfr.lata.LATA4;
+    if (relay && !last_relay) {
+        counters.relay_pulses++;
+        if (sim_vbat + cap_v < RELAY_OPERATE_V) {
+            counters.weak_pulses++;
+        }
+        air_relay(sim_sfr.lata.LATA4);
+    }
+    last_relay = relay;
+}
+
+volatile sim_late_t *sim_late(void) {
+    static int touched;
+    if (!touched) {
+        counters.nrf_first = sim_now;
+        touched = 1;
+    }
+    pins_sync();
+    return &sim_sfr.late;
+}
+
+/* <ACCOUNTING> */
+
+static int current_state(void) {
+    int pulse = (sim_sfr.lata.LATA3 || sim_sfr.lata.LATA4) && !sim_sfr.lata.LATA1;
+    int charge = !sim_sfr.lata.LATA0 && sim_sfr.lata.LATA2;
+    enum radio_state rs = radio_state();
+    if (in_spi) return ST_SPI;
+    if (pulse) return ST_RELAY;
+    if (charge) return ST_RECHARGE;
+    if (rs == RADIO_RX || rs == RADIO_RX_SETTLE || rs == RADIO_ACK) return ST_RX;
+    if (rs == RADIO_TX || rs == RADIO_TX_SETTLE || rs == RADIO_WAIT_ACK) return ST_TX;
+    if (sleeping) return ST_SLEEP;
+    return ST_ACTIVE;
+}
+
+// battery charge in uA*s drawn by the relay stage over dt
+static double relay_stage(double dt_s) {
+    int pulse = (sim_sfr.lata.LATA3 || sim_sfr.lata.LATA4) && !sim_sfr.lata.LATA1;
+    int charge = !sim_sfr.lata.LATA0 && sim_sfr.lata.LATA2;
+    double v0 = cap_v;
+    if (pulse) {
+        // battery and capacitor in series drive the coil
+        double tau = RELAY_COIL_OHM * CAP_F;
+        cap_v = (v0 + sim_vbat) * exp(-dt_s / tau) - sim_vbat;
+        if (cap_v < 0) {
+            cap_v = 0;
+        }
+        return (v0 - cap_v) * CAP_F * 1e6;
+    }
+    if (charge) {
+        double tau = CAP_CHARGE_OHM * CAP_F;
+        cap_v = sim_vbat - (sim_vbat - v0) * exp(-dt_s / tau);
+        return (cap_v - v0) * CAP_F * 1e6;
+    }
+    return 0;
+}
+
+static void account(sim_time_t dt) {
+    if (dt == 0) {
+        return;
+    }
+    double dt_s = dt / 1e9;
+    double ua = radio_current_ua();
+    if (sleeping) {
+        ua += MCU_SLEEP_UA;
+    } else {
+        double f = sim_fosc_hz();
+        ua += run_ua(f);
+        // awake time below the fastest clock the firmware has used,
+        // and what it would have cost there
+        if (f > counters.fosc_top) {
+            counters.fosc_top = f;
+        }
+        counters.awake_ns += dt;
+        if (f < counters.fosc_top) {
+            counters.slow_ns += dt;
+            counters.slow_saved_uas += (run_ua(counters.fosc_top) - run_ua(f)) * dt_s;
+        }
+    }
+    if (sim_sfr.osccon.IRCF < 8) {
+        hf_running = 0;
+    }
+    if (sim_sfr.latd.LATD2 && !sim_sfr.trisd.TRISD2) {
+        ua += LED_UA;
+    }
+    if (sim_sfr.fvrcon.FVREN) {
+        ua += FVR_UA;
+    }
+    int st = current_state();
+    state_ns[st] += dt;
+    state_uas[st] += ua * dt_s + relay_stage(dt_s);
+    sense_v += (cap_v * CAP_SENSE_DIVIDER - sense_v) * (1 - exp(-dt_s / CAP_SENSE_TAU_S));
+}
+
+/* <TIME> */
+
+static int wake_pending(void) {
+    if (sim_sfr.intcon.IOCIE && sim_sfr.iocbf.reg) return 1;
+    if (sim_sfr.pie1.TMR1IE && sim_sfr.pir1.TMR1IF) return 1;
+    if (sim_sfr.pie1.SSPIE && sim_sfr.pir1.SSPIF) return 1;
+    return 0;
+}
+
+static int uart_txif(void);
+
+static int interrupt_pending(void) {
+    if (sim_sfr.intcon.IOCIE && sim_sfr.iocbf.reg) return 1;
+    if (sim_sfr.intcon.TMR0IE && sim_sfr.intcon.TMR0IF) return 1;
+    if (!sim_sfr.intcon.PEIE) return 0;
+    return (sim_sfr.pie1.TMR1IE && sim_sfr.pir1.TMR1IF)
+        || (sim_sfr.pie1.SSPIE && sim_sfr.pir1.SSPIF)
+        || (sim_sfr.pie1.TXIE && uart_txif());
+}
+
+static void ssp_complete(void) {
+    pins_sync();
+    ssp_rx = sim_sfr.sspcon1.SSPEN ? radio_spi(ssp_tx) : 0x00;
+    ssp_state = SSP_DONE;
+    sim_sfr.sspstat.BF = 1;
+    sim_sfr.pir1.SSPIF = 1;
+    counters.spi_bytes++;
+    if (!counters.ready_at) {
+        counters.spi_last = sim_now;
+    }
+    pins_sync();
+}
+
+// run the world until target, or until a wake-up source fires in sleep
+static void advance_to(sim_time_t target) {
+    pins_sync();
+    timer0_load();
+    timer1_load();
+    while (sim_now < target) {
+        sim_time_t next = target;
+        sim_time_t t;
+        if ((t = radio_next_event()) < next) next = t;
+        if ((t = timer1_next_event()) < next) next = t;
+        if ((t = air_next_event()) < next) next = t;
+        if ((t = debug_next_event()) < next) next = t;
+        if (ssp_state == SSP_LOADED && !sleeping && ssp_done_at < next) {
+            next = ssp_done_at;
+        }
+        if (sim_end < next) next = sim_end;
+        if (next < sim_now) next = sim_now;
+
+        account(next - sim_now);
+        timer0_run(next - sim_now);
+        timer1_run(next - sim_now);
+        sim_now = next;
+        sim_vbat = vbat_start + (vbat_end - vbat_start) * sim_now / sim_end;
+
+        if (ssp_state == SSP_LOADED && !sleeping && sim_now >= ssp_done_at) {
+            ssp_complete();
+            in_spi = 0;
+        }
+        radio_step();
+        air_step();
+        debug_step();
+        pins_sync();
+
+        if (sim_now >= sim_end) {
+            timer0_store();
+            timer1_store();
+            longjmp(sim_exit, 1);
+        }
+        if (sleeping && wake_pending()) {
+            break;
+        }
+    }
+    timer0_store();
+    timer1_store();
+}
+
+static void dispatch(void) {
+    while (!in_isr && sim_sfr.intcon.GIE && interrupt_pending()) {
+        in_isr = 1;
+        sim_sfr.intcon.GIE = 0;
+        counters.interrupts++;
+        sim_time_t start = sim_now;
+        advance_to(sim_now + cycles_ns(ISR_CYCLES));
+        int_handler();
+        if (sim_now - start > counters.isr_worst) {
+            counters.isr_worst = sim_now - start;
+        }
+        sim_sfr.intcon.GIE = 1;
+        in_isr = 0;
+    }
+}
+
+/* <ADC> */
+
+// A conversion started with GO finishes when the firmware polls for it,
+// 11.5 TAD later. AN4 (the capacitor sense divider, lagging the capacitor
+// by its RC) and the FVR buffer are wired; references are VDD/VSS.
+static double adc_input(void) {
+    static const double fvr_v[4] = { 0, 1.024, 2.048, 4.096 };
+    switch (sim_sfr.adcon0.CHS) {
+        case 4: return sense_v;
+        case 31: return sim_sfr.fvrcon.FVRRDY ? fvr_v[sim_sfr.fvrcon.ADFVR] : 0;
+        default: return 0;
+    }
+}
+
+volatile sim_adcon0_t *sim_adcon0(void) {
+    if (sim_sfr.adcon0.GO_nDONE && sim_sfr.adcon0.ADON) {
+        static const int tad_div[8] = { 2, 8, 32, 0, 4, 16, 64, 0 };
+        int div = tad_div[sim_sfr.adcon1.ADCS];
+        advance_to(sim_now + (div ? (sim_time_t)(11.5 * div * 1e9 / sim_fosc_hz()) : 46 * SIM_US));
+        int result = (int)(adc_input() / sim_vbat * 1024);
+        result = result < 0 ? 0 : result > 1023 ? 1023 : result;
+        if (sim_sfr.adcon1.ADFM) {
+            sim_sfr.adresh = result >> 8;
+            sim_sfr.adresl = result & 0xFF;
+        } else {
+            sim_sfr.adresh = result >> 2;
+            sim_sfr.adresl = (result & 3) << 6;
+        }
+        sim_sfr.adcon0.GO_nDONE = 0;
+    }
+    return &sim_sfr.adcon0;
+}
+
+// the FVR is ready FVR_SETTLE_NS after it is enabled, polled like GO
+volatile sim_fvrcon_t *sim_fvrcon(void) {
+    if (!sim_sfr.fvrcon.FVREN) {
+        sim_sfr.fvrcon.FVRRDY = 0;
+    } else if (!sim_sfr.fvrcon.FVRRDY) {
+        advance_to(sim_now + FVR_SETTLE_NS);
+        sim_sfr.fvrcon.FVRRDY = 1;
+    }
+    return &sim_sfr.fvrcon;
+}
+
+// switching back to HFINTOSC takes HFINTOSC_START_NS, which the
+// firmware waits out polling HFIOFR
+volatile sim_oscstat_t *sim_oscstat(void) {
+    int hf = sim_sfr.osccon.IRCF >= 8;
+    if (hf && !hf_running) {
+        advance_to(sim_now + HFINTOSC_START_NS);
+    }
+    hf_running = hf;
+    sim_sfr.oscstat.reg = 0;
+    sim_sfr.oscstat.HFIOFR = hf;
+    sim_sfr.oscstat.HFIOFS = hf;
+    sim_sfr.oscstat.MFIOFR = 1;
+    sim_sfr.oscstat.LFIOFR = 1;
+    return &sim_sfr.oscstat;
+}
+
+/* <EUSART> */
+
+// Transmit only. A byte written to TXREG takes 10 bit times; polling
+// TRMT is where the time passes, and TXIF only comes up once the byte
+// has gone (TXREG isn't double-buffered here). The bytes go to the -u
+// file.
+static const char *uart_file;
+static FILE *uart_out;
+static int uart_loaded;
+static sim_time_t uart_done_at;
+static unsigned long uart_bytes;
+
+static sim_time_t uart_bit_ns(void) {
+    unsigned n = sim_sfr.spbrgh << 8 | sim_sfr.spbrgl;
+    int div = sim_sfr.baudcon.BRG16 ? (sim_sfr.txsta.BRGH ? 4 : 16)
+                                    : (sim_sfr.txsta.BRGH ? 16 : 64);
+    return (sim_time_t)(div * (n + 1) * 1e9 / sim_fosc_hz());
+}
+
+// the TXREG write lands after sim_txreg() returns, so the byte is
+// picked up at the next EUSART access
+static void uart_shift(void) {
+    if (!uart_loaded) {
+        return;
+    }
+    uart_loaded = 0;
+    if (sim_sfr.rcsta.SPEN && sim_sfr.txsta.TXEN) {
+        uart_bytes++;
+        if (uart_out) {
+            fputc(sim_sfr.txreg, uart_out);
+        }
+    }
+}
+
+static int uart_txif(void) {
+    return sim_sfr.rcsta.SPEN && sim_sfr.txsta.TXEN && sim_now >= uart_done_at;
+}
+
+volatile unsigned char *sim_txreg(void) {
+    uart_shift();
+    uart_loaded = 1;
+    uart_done_at = sim_now + 10 * uart_bit_ns();
+    return &sim_sfr.txreg;
+}
+
+volatile sim_txsta_t *sim_txsta(void) {
+    uart_shift();
+    if (sim_now < uart_done_at) {
+        advance_to(uart_done_at);
+    }
+    sim_sfr.txsta.TRMT = 1;
+    return &sim_sfr.txsta;
+}
+
+/* <FLASH> */
+
+// Only the High-Endurance Flash rows at the top of program memory are
+// kept; they start erased or are loaded from the -m file and saved
+// back to it. Reads (RD) and self-writes (WR) take effect at the next
+// NOP() or delay, which is where the part stalls for them. The firmware
+// programs one word at a time with the other latches left at 0x3FFF, so
+// a write only touches the addressed word.
+#define HEF_START 0x1F80
+#define HEF_WORDS 128
+#define FLASH_ROW 32
+
+static unsigned short hef[HEF_WORDS];
+static unsigned char pmcon2_before; // PMCON2 before the latest write
+static const char *hef_file;
+
+volatile unsigned char *sim_pmcon2(void) {
+    pmcon2_before = sim_sfr.pmcon2;
+    return &sim_sfr.pmcon2;
+}
+
+static void flash_step(void) {
+    volatile sim_pmcon1_t *c = &sim_sfr.pmcon1;
+    if (!c->RD && !c->WR) {
+        return;
+    }
+    unsigned addr = (sim_sfr.pmadrh << 8 | sim_sfr.pmadrl) & 0x7FFF;
+    int in_hef = !c->CFGS && addr >= HEF_START && addr < HEF_START + HEF_WORDS;
+    if (c->RD) {
+        unsigned w = in_hef ? hef[addr - HEF_START] : 0x3FFF;
+        sim_sfr.pmdath = w >> 8;
+        sim_sfr.pmdatl = w & 0xFF;
+        c->RD = 0;
+    }
+    if (c->WR) {
+        // 0x55 then 0xAA to PMCON2 right before setting WR
+        int unlocked = pmcon2_before == 0x55 && sim_sfr.pmcon2 == 0xAA;
+        pmcon2_before = sim_sfr.pmcon2 = 0;
+        c->WR = 0;
+        if (!c->WREN || !unlocked) {
+            c->WRERR = 1;
+            return;
+        }
+        if (c->FREE) {
+            counters.flash_erases++;
+            if (in_hef) {
+                unsigned row = (addr - HEF_START) & ~(FLASH_ROW - 1);
+                for (unsigned i = 0; i < FLASH_ROW; i++) {
+                    hef[row + i] = 0x3FFF;
+                }
+            }
+        } else if (!c->LWLO) {
+            counters.flash_writes++;
+            if (in_hef) {
+                // programming only clears bits
+                hef[addr - HEF_START] &= (sim_sfr.pmdath << 8 | sim_sfr.pmdatl) & 0x3FFF;
+            }
+        } else {
+            return; // latch loads don't stall
+        }
+        advance_to(sim_now + FLASH_WRITE_NS);
+    }
+}
+
+static void hef_load(void) {
+    for (int i = 0; i < HEF_WORDS; i++) {
+        hef[i] = 0x3FFF;
+    }
+    FILE *f = hef_file ? fopen(hef_file, "r") : NULL;
+    if (f) {
+        unsigned w;
+        for (int i = 0; i < HEF_WORDS && fscanf(f, "%x", &w) == 1; i++) {
+            hef[i] = w & 0x3FFF;
+        }
+        fclose(f);
+    }
+}
+
+static void hef_save(void) {
+    FILE *f = hef_file ? fopen(hef_file, "w") : NULL;
+    if (f) {
+        for (int i = 0; i < HEF_WORDS; i++) {
+            fprintf(f, "%04X%c", hef[i], i % 8 == 7 ? '\n' : ' ');
+        }
+        fclose(f);
+    }
+}
+
+void sim_delay_cycles(unsigned long cycles) {
+    flash_step();
+    advance_to(sim_now + cycles_ns(cycles));
+    dispatch();
+}
+
+static void boot_done(void) {
+    if (!counters.ready_at) {
+        counters.ready_at = sim_now;
+    }
+}
+
+void sim_sleep(void) {
+    boot_done();
+    pins_sync();
+    if (!wake_pending()) {
+        sleeping = 1;
+        advance_to(SIM_NEVER);
+        sleeping = 0;
+        counters.wakeups++;
+    }
+    dispatch();
+}
+
+volatile unsigned char *sim_sspbuf(void) {
+    if (ssp_state == SSP_DONE) {
+        // reading the result clears BF
+        ssp_state = SSP_IDLE;
+        sim_sfr.sspstat.BF = 0;
+        return &ssp_rx;
+    }
+    ssp_state = SSP_LOADED;
+    ssp_done_at = sim_now + ssp_byte_ns();
+    in_spi = 1;
+    return &ssp_tx;
+}
+
+volatile sim_sspstat_t *sim_sspstat(void) {
+    if (ssp_state == SSP_LOADED) {
+        // the firmware is polling BF: let the transfer finish
+        advance_to(ssp_done_at + cycles_ns(SPI_CALL_CYCLES));
+        in_spi = 0;
+    }
+    if (ssp_state == SSP_DONE) {
+        sim_sfr.sspstat.BF = 1;
+    }
+    return &sim_sfr.sspstat;
+}
+
+// a port read costs an instruction, so polling loops move time forward
+volatile sim_portb_t *sim_portb(void) {
+    sim_delay_cycles(1);
+    return &sim_sfr.portb;
+}
+
+volatile sim_portc_t *sim_portc(void) {
+    boot_done();
+    sim_delay_cycles(1);
+    return &sim_sfr.portc;
+}
+
+// so do the flag tests, which is most of what the interrupt handler
+// does after it zeroes Timer0 to time itself
+volatile sim_iocbf_t *sim_iocbf(void) {
+    sim_delay_cycles(1);
+    return &sim_sfr.iocbf;
+}
+
+volatile sim_pir1_t *sim_pir1(void) {
+    sim_delay_cycles(1);
+    sim_sfr.pir1.TXIF = uart_txif();
+    return &sim_sfr.pir1;
+}
+
+// setting GIE lets pending interrupts in; the write lands after this
+// returns, so they are taken at the next INTCON access or delay
+volatile sim_intcon_t *sim_intcon(void) {
+    dispatch();
+    return &sim_sfr.intcon;
+}
+
+/* <REPORT> */
+
+static void report(void) {
+    double total_ns = 0, total_uas = 0;
+    for (int i = 0; i < ST_COUNT; i++) {
+        total_ns += state_ns[i];
+        total_uas += state_uas[i];
+    }
+    printf("simulated %.3f s, mode %d build\n", sim_now / 1e9, SIM_MODE);
+    printf("%-12s %14s %14s %7s\n", "state", "time [us]", "charge [uA*s]", "share");
+    for (int i = 0; i < ST_COUNT; i++) {
+        printf("%-12s %14.1f %14.3f %6.2f%%\n", state_names[i],
+               state_ns[i] / 1e3, state_uas[i],
+               total_uas ? 100 * state_uas[i] / total_uas : 0);
+    }
+    printf("%-12s %14.1f %14.3f\n", "total", total_ns / 1e3, total_uas);
+
+    double avg_ua = total_ns ? total_uas / (total_ns / 1e9) : 0;
+    printf("average current %.2f uA", avg_ua);
+    if (avg_ua > 0) {
+        printf(", %.0f days on %.0f mAh", BATTERY_MAH * 1e3 / avg_ua / 24, BATTERY_MAH);
+    }
+    printf("\n");
+    printf("wakeups %lu, interrupts %lu, timer1 overflows %lu, spi bytes %lu, "
+           "relay pulses %lu\n",
+           counters.wakeups, counters.interrupts, counters.timer1_overflows,
+           counters.spi_bytes, counters.relay_pulses);
+    if (counters.weak_pulses) {
+        printf("relay pulses below %.2f V must-operate %lu\n",
+               RELAY_OPERATE_V, counters.weak_pulses);
+    }
+    unsigned long skipped = air_skipped();
+    if (skipped && counters.relay_pulses) {
+        double per_pulse = (state_uas[ST_RELAY] + state_uas[ST_RECHARGE]) / counters.relay_pulses;
+        printf("relay pulses skipped %lu, %.3f uA*s saved at %.3f uA*s each\n",
+               skipped, skipped * per_pulse, per_pulse);
+    }
+    if (uart_bytes) {
+        printf("uart bytes %lu\n", uart_bytes);
+    }
+    if (counters.flash_erases || counters.flash_writes) {
+        printf("flash row erases %lu, word writes %lu\n",
+               counters.flash_erases, counters.flash_writes);
+    }
+    if (counters.wakeups) {
+        printf("awake %.1f us per wake-up, %.1f us of it below %.0f MHz, "
+               "%.4f uA*s saved per wake-up (%.3f uA*s in all)\n",
+               counters.awake_ns / 1e3 / counters.wakeups,
+               counters.slow_ns / 1e3 / counters.wakeups, counters.fosc_top / 1e6,
+               counters.slow_saved_uas / counters.wakeups, counters.slow_saved_uas);
+    }
+    printf("longest interrupt %.1f us\n", counters.isr_worst / 1e3);
+    printf("boot to listening %.3f ms, nRF setup %.1f us\n", counters.ready_at / 1e6,
+           (counters.spi_last - counters.nrf_first) / 1e3);
+    printf("tx packets %lu (%.3f ms on air), rx packets %lu, rx fifo overflows %lu\n",
+           radio_stats.tx_packets, radio_stats.tx_airtime / 1e6,
+           radio_stats.rx_packets, radio_stats.rx_overflow);
+    printf("acks sent %lu, acks received %lu\n",
+           radio_stats.acks_sent, radio_stats.acks_received);
+    if (radio_stats.tx_overlong) {
+        printf("TX mode held past 4 ms %lu times\n", radio_stats.tx_overlong);
+    }
+    if (counters.resets) {
+        printf("main() returned %lu times\n", counters.resets);
+    }
+    air_report();
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "usage: %s [-t seconds] [-v volts[:end_volts]] [-p ms[:on|off]]... "
+            "[-l loss%%] [-e bit_error_rate] [-n noise_hz] [-F fec_copies] [-C crc] [-M frames] [-b packets] [-s spacing_us] [-h hold_ms] "
+            "[-w period_ms] [-c skew%%] [-k channel] [-f hopping] [-R rate] [-H home_rate] [-r dbm] [-i channel:duty%%] [-a address] [-m hef_file] [-d dump_ms]... [-u uart_file]\n",
+            argv0);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    int presses = 0;
+    for (int i = 1; i < argc; i++) {
+        const char *opt = argv[i];
+        if (opt[0] != '-' || !opt[1] || opt[2] || i + 1 >= argc) {
+            usage(argv[0]);
+        }
+        const char *arg = argv[++i];
+        switch (opt[1]) {
+            case 't': sim_end = (sim_time_t)(atof(arg) * SIM_S); break;
+            case 'v': {
+                const char *colon = strchr(arg, ':');
+                vbat_start = atof(arg);
+                vbat_end = colon ? atof(colon + 1) : vbat_start;
+                sim_vbat = vbat_start;
+                break;
+            }
+            case 'l': air_config.loss = atof(arg) / 100; break;
+            case 'e': air_config.ber = atof(arg); break;
+            case 'n': air_config.noise = atof(arg); break;
+            case 'F': air_config.fec_copies = atoi(arg); break;
+            case 'C': air_config.crc = atoi(arg); break;
+            case 'M': air_config.frames = atoi(arg); break;
+            case 'b': air_config.burst = strtoul(arg, NULL, 0); break;
+            case 's': air_config.spacing = (sim_time_t)(atof(arg) * SIM_US); break;
+            case 'h': air_config.hold = (sim_time_t)(atof(arg) * SIM_MS); break;
+            case 'w': air_config.period = (sim_time_t)(atof(arg) * SIM_MS); break;
+            case 'c': air_config.skew = atof(arg) / 100; break;
+            case 'k': air_config.moved_to = atoi(arg); break;
+            case 'f': air_config.hopping = atoi(arg); break;
+            case 'R': air_config.rate = atoi(arg); break;
+            case 'H': air_config.home_rate = atoi(arg); break;
+            case 'r': air_config.dbm = atoi(arg); break;
+            case 'i': {
+                const char *colon = strchr(arg, ':');
+                if (!colon) {
+                    usage(argv[0]);
+                }
+                air_config.busy_channel = atoi(arg);
+                air_config.busy_duty = atof(colon + 1) / 100;
+                break;
+            }
+            case 'a':
+                if (strlen(arg) != 5) {
+                    usage(argv[0]);
+                }
+                air_config.addr = arg;
+                break;
+            case 'm': hef_file = arg; break;
+            case 'd': dump_request((sim_time_t)(atof(arg) * SIM_MS)); break;
+            case 'u': uart_file = arg; break;
+            case 'p': {
+                const char *colon = strchr(arg, ':');
+                air_press((sim_time_t)(atof(arg) * SIM_MS),
+                          !colon || strcmp(colon + 1, "off") != 0);
+                presses++;
+                break;
+            }
+            default: usage(argv[0]);
+        }
+    }
+    if (!presses) {
+        air_press(2 * SIM_S, 1);
+        air_press(6 * SIM_S, 0);
+    }
+
+    // power-on reset values
+    memset((void *)&sim_sfr, 0, sizeof(sim_sfr));
+    sim_sfr.osccon.reg = 0x38;
+    sim_sfr.trisa.reg = sim_sfr.trisb.reg = sim_sfr.trisc.reg = 0xFF;
+    sim_sfr.trisd.reg = sim_sfr.trise.reg = 0xFF;
+    sim_sfr.ansela.reg = sim_sfr.anselb.reg = sim_sfr.anselc.reg = 0xFF;
+    sim_sfr.anseld.reg = sim_sfr.ansele.reg = 0xFF;
+    sim_sfr.portb.RB0 = 1;
+    sim_sfr.portb.RB1 = 1; // debug pin pulled up
+    sim_sfr.wpub = 0xFF;
+    sim_sfr.option_reg.nWPUEN = 1;
+    sim_sfr.txsta.TRMT = 1;
+    radio_reset();
+    air_reset();
+    hef_load();
+    if (uart_file && !(uart_out = fopen(uart_file, "wb"))) {
+        perror(uart_file);
+        exit(1);
+    }
+
+    if (setjmp(sim_exit) == 0) {
+        for (;;) {
+            firmware_main();
+            // XC8 jumps back to the reset vector when main() returns
+            counters.resets++;
+        }
+    }
+    hef_save();
+    if (uart_out) {
+        fclose(uart_out);
+    }
+    report();
+    return 0;
+}
@@ -0,0 +1,143 @@
+/*
+ * File:   sim.h
+ *
+ * Internal interface between the parts of the host simulator:
+ * sim.c (MCU core, board and energy accounting), radio.c (nRF24L01)
+ * and air.c (the scripted other end of the link).
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include "pic16f1519.h"
+
+typedef unsigned long long sim_time_t; // nanoseconds
+
+#define SIM_US 1000ULL
+#define SIM_MS 1000000ULL
+#define SIM_S  1000000000ULL
+#define SIM_NEVER (~0ULL)
+
+extern sim_time_t sim_now;
+
+/* <MCU> */
+
+double sim_fosc_hz(void);
+
+/* <RADIO> */
+
+enum radio_state {
+    RADIO_PWR_DOWN,
+    RADIO_STARTUP,    // crystal start-up, Tpd2stby
+    RADIO_STANDBY_I,
+    RADIO_STANDBY_II,
+    RADIO_RX_SETTLE,
+    RADIO_RX,
+    RADIO_TX_SETTLE,
+    RADIO_TX,
+    RADIO_WAIT_ACK,   // PTX listening for the ACK after a packet
+    RADIO_ACK         // PRX sending an ACK
+};
+
+// data rates in the order RF_SETUP encodes them
+enum { RATE_1M, RATE_2M, RATE_250K };
+
+typedef struct {
+    sim_time_t start, end;
+    unsigned char channel;
+    unsigned char rate;
+    unsigned char aw;        // address width in bytes
+    unsigned char addr[5];
+    unsigned char len;
+    unsigned char payload[32];
+    unsigned char crc;       // CRC length in bytes, 0 = off
+    unsigned char pcf;       // packet control field present
+    unsigned char crc_ok;    // 0 if the air corrupted the packet
+    unsigned char noack;     // W_TX_PAYLOAD_NOACK or auto-ack off
+    int dbm;                 // power at the receiver
+    int burst;               // scripted press the packet belongs to, -1 if none
+} air_packet_t;
+
+struct radio_stats {
+    unsigned long tx_packets;
+    unsigned long rx_packets;
+    unsigned long rx_overflow;
+    unsigned long acks_sent;
+    unsigned long acks_received;
+    sim_time_t tx_airtime;
+    unsigned long tx_overlong; // stretches in TX mode past the 4 ms limit
+};
+extern struct radio_stats radio_stats;
+
+void radio_reset(void);
+void radio_pins(int csn, int ce);
+unsigned char radio_spi(unsigned char mosi);
+sim_time_t radio_next_event(void);
+void radio_step(void);
+int radio_irq(void);
+enum radio_state radio_state(void);
+double radio_current_ua(void);
+sim_time_t radio_airtime(const air_packet_t *pkt);
+int radio_sensitivity(int rate);
+int radio_pipe_width(int pipe);
+void radio_air_format(air_packet_t *pkt);
+
+/* <AIR> */
+
+struct air_config {
+    double loss;          // fraction of packets lost on air
+    double ber;           // bit error rate on the scripted remote's payloads
+    double noise;         // garbage frames per second that get past the
+                          // switch's address match
+    int fec_copies;       // scripted remote's payload format: FEC copies,
+                          // 0 = the bare command character...
+    int crc;              // ...followed by a CRC-16 if set
+    int frames;           // ...or, if set, a command frame (command_frames,
+                          // see <FRAMES>): 1 = set the relay, 2 = the
+                          // same for unit 1 behind a group address,
+                          // 3 = recall scene 0 (on) or 1 (off), 4 = set
+                          // unit 2 (not this switch); -1 = a frame setting
+                          // the relay if the switch's pipe 0 is as wide
+                          // as a full frame, else the command character
+    unsigned long burst;  // packets per press sent by the scripted remote
+    sim_time_t spacing;   // start-to-start time of those packets
+    sim_time_t hold;      // how long a scripted button press lasts
+    sim_time_t period;    // scripted switch: listen period...
+    sim_time_t window;    // ...and window length,
+    sim_time_t fast;      // ...period for fast_hold after an ACK, 0 = none
+    sim_time_t fast_hold;
+    double skew;          // ...and how much faster its Timer1 runs,
+                          // the ACKs carry its count (see <WAKE SYNC>)
+    int moved_to;         // ...and the channel it has moved to, 0 = none;
+                          // then its ACKs carry it too (see <CHANNELS>)
+    int hopping;          // both ends hop, channel_select 2
+    int rate;             // scripted switch: rate it has agreed on, as
+                          // rate_select counts them, -1 = none; then its
+                          // ACKs carry it, and the channel (<DATA RATE>);
+                          // scripted remote: the rate it starts on
+    int home_rate;        // rate both ends start on, rate_home
+    int dbm;              // power either end receives the other at
+    int home;             // RF_CH both ends start on, channel_home
+    int busy_channel;     // centre of a 20 MHz wide interferer...
+    double busy_duty;     // ...and the share of time it is on air
+    const char *addr;     // scripted remote: address to send to, 0 = the
+                          // switch's own (pipe 0)
+};
+extern struct air_config air_config;
+
+void air_press(sim_time_t at, int on);
+void air_reset(void);
+int air_next(sim_time_t from, sim_time_t after, air_packet_t *pkt);
+int air_transmit(const air_packet_t *pkt, air_packet_t *ack);
+void air_ack(const air_packet_t *pkt, const unsigned char *payload, int len);
+sim_time_t air_busy(int channel, sim_time_t from, sim_time_t to);
+sim_time_t air_next_event(void);
+void air_step(void);
+void air_relay(int on);
+unsigned long air_skipped(void);
+void air_report(void);
+
+extern double sim_vbat;
+extern sim_time_t sim_end;
+
+#endif
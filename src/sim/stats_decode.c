@@ -0,0 +1,172 @@
+/*
+ * File:   stats_decode.c
+ *
+ * Turns a stats dump from the switch (see <STATS> in transceiver.c,
+ * built with stats=1) into time and charge per state and an estimated
+ * battery drain in uAh/day. Reads the raw EUSART bytes from a file or
+ * stdin, e.g. a serial capture or sim_rx -u.
+ *
+ * The currents are the same datasheet typicals at 3 V the simulator
+ * uses; the relay figures assume the 125 ohm coil and the 2200 uF
+ * doubling capacitor. The time base is LFINTOSC, good to +-15%.
+ *
+ * A switch built with channel_select adds three words per channel to
+ * the dump, see <CHANNELS>: RPD samples, how many found a carrier and
+ * commands heard there. The flags word says whether it was built with
+ * rx_power_down: then the nRF sits in standby only for the start-up
+ * ahead of each window and is powered down the rest of the time outside
+ * them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define STATS_VERSION 1 // stats_version in transceiver.c
+
+#define TIMER1_TICKS_PER_S 3875.0 // LFINTOSC / 8
+#define TIMER0_TICK_US     1.0    // Fosc/4 / 4 at 16 MHz
+#define SPI_BYTE_US        2.0    // 8 bits at Fosc/4 = 4 MHz
+
+#define MCU_SLEEP_UA   11.0
+#define MCU_RUN_UA     1790.0  // 16 MHz HFINTOSC
+#define NRF_STANDBY_UA 22.0    // standby-I between windows...
+#define NRF_DOWN_UA    0.9     // ...or powered down, with rx_power_down
+#define NRF_STARTUP_S  1.75e-3 // nrf_startup_us, in standby ahead of a window
+#define NRF_RX_UA      12300.0 // 2 Mbps
+// battery and capacitor in series through the coil, averaged over a
+// 50 ms pulse; the recharge then puts the same charge back
+#define RELAY_PULSE_UA 44000.0
+#define LED_UA         2000.0
+#define BATTERY_MAH    2000.0
+
+enum {
+    W_TOTAL, W_SLEEP, W_RX, W_PULSE, W_CHARGE, W_LED, W_ISR_TICKS, W_INTERRUPTS,
+    W_SPI_BYTES, W_WINDOWS, W_EMPTY_WINDOWS, W_PULSES, W_COMMANDS,
+    W_CARRIER_CHECKS, W_CARRIER_HITS, W_FLAGS,
+    W_COUNT
+};
+
+static const int channel_list[] = { 2, 25, 50, 75, 80 }; // as in transceiver.c
+#define FLAG_RX_POWER_DOWN 0x01 // STATS_RX_POWER_DOWN
+
+#define CHANNEL_LIST_COUNT (int)(sizeof(channel_list) / sizeof(channel_list[0]))
+
+static void row(const char *name, double s, double total_s, double uas) {
+    double uah = uas / 3600;
+    printf("%-12s %12.3f %6.2f%% %12.3f %12.1f\n", name, s,
+           total_s ? 100 * s / total_s : 0, uah, total_s ? uah * 86400 / total_s : 0);
+}
+
+int main(int argc, char **argv) {
+    FILE *f = argc > 1 ? fopen(argv[1], "rb") : stdin;
+    if (!f) {
+        perror(argv[1]);
+        return 1;
+    }
+    // find the last complete, valid dump in the capture
+    unsigned long w[64];
+    int found = 0, channels = 0;
+    int c, prev = -1;
+    while ((c = getc(f)) != EOF) {
+        if (prev != 0xA5 || c != 0x5A) {
+            prev = c;
+            continue;
+        }
+        prev = -1;
+        int version = getc(f), count = getc(f);
+        if (version != STATS_VERSION || count < W_COUNT || count > 64
+            || (count - W_COUNT) % 3) {
+            continue;
+        }
+        unsigned long words[64];
+        unsigned char sum = 0;
+        int ok = 1;
+        for (int i = 0; i < count && ok; i++) {
+            words[i] = 0;
+            for (int b = 0; b < 4; b++) {
+                int byte = getc(f);
+                if (byte == EOF) {
+                    ok = 0;
+                    break;
+                }
+                words[i] |= (unsigned long)byte << (8 * b);
+                sum += byte;
+            }
+        }
+        int check = getc(f);
+        if (!ok || check == EOF || (unsigned char)(sum + check) != 0) {
+            continue;
+        }
+        for (int i = 0; i < count; i++) {
+            w[i] = words[i];
+        }
+        channels = (count - W_COUNT) / 3;
+        found = 1;
+    }
+    if (!found) {
+        fprintf(stderr, "no valid stats dump found\n");
+        return 1;
+    }
+
+    double total_s = w[W_TOTAL] / TIMER1_TICKS_PER_S;
+    double sleep_s = w[W_SLEEP] / TIMER1_TICKS_PER_S;
+    double awake_s = total_s - sleep_s;
+    double rx_s = w[W_RX] / TIMER1_TICKS_PER_S;
+    double pulse_s = w[W_PULSE] / TIMER1_TICKS_PER_S;
+    double charge_s = w[W_CHARGE] / TIMER1_TICKS_PER_S;
+    double led_s = w[W_LED] / TIMER1_TICKS_PER_S;
+    double pulse_uas = pulse_s * RELAY_PULSE_UA;
+    double standby_s = total_s - rx_s, down_s = 0;
+    if (w[W_FLAGS] & FLAG_RX_POWER_DOWN) {
+        down_s = standby_s - w[W_WINDOWS] * NRF_STARTUP_S;
+        down_s = down_s > 0 ? down_s : 0;
+        standby_s -= down_s;
+    }
+
+    printf("%.3f s since boot (Timer1, +-15%%)\n", total_s);
+    printf("%-12s %12s %7s %12s %12s\n", "state", "time [s]", "share", "charge [uAh]", "[uAh/day]");
+    row("mcu sleep", sleep_s, total_s, sleep_s * MCU_SLEEP_UA);
+    row("mcu awake", awake_s, total_s, awake_s * MCU_RUN_UA);
+    row("nrf standby", standby_s, total_s, standby_s * NRF_STANDBY_UA);
+    row("nrf down", down_s, total_s, down_s * NRF_DOWN_UA);
+    row("rx window", rx_s, total_s, rx_s * NRF_RX_UA);
+    row("relay pulse", pulse_s, total_s, pulse_uas);
+    row("recharge", charge_s, total_s, pulse_uas);
+    row("led", led_s, total_s, led_s * LED_UA);
+    double total_uas = sleep_s * MCU_SLEEP_UA + awake_s * MCU_RUN_UA
+                       + standby_s * NRF_STANDBY_UA + down_s * NRF_DOWN_UA + rx_s * NRF_RX_UA
+                       + 2 * pulse_uas + led_s * LED_UA;
+    row("total", total_s, total_s, total_uas);
+    if (total_s > 0 && total_uas > 0) {
+        double avg_ua = total_uas / total_s;
+        printf("average current %.2f uA, %.0f days on %.0f mAh\n",
+               avg_ua, BATTERY_MAH * 1e3 / avg_ua / 24, BATTERY_MAH);
+    }
+    printf("interrupts %lu, %.3f ms in the handler\n",
+           w[W_INTERRUPTS],
+           w[W_ISR_TICKS] * TIMER0_TICK_US / 1e3);
+    printf("spi bytes %lu (%.3f ms on the bus)\n",
+           w[W_SPI_BYTES], w[W_SPI_BYTES] * SPI_BYTE_US / 1e3);
+    printf("rx windows %lu, %lu empty, %lu with a packet\n",
+           w[W_WINDOWS], w[W_EMPTY_WINDOWS], w[W_WINDOWS] - w[W_EMPTY_WINDOWS]);
+    if (w[W_CARRIER_CHECKS]) {
+        unsigned long hits = w[W_CARRIER_HITS], misses = w[W_CARRIER_CHECKS] - hits;
+        printf("carrier detect: %lu hits, %lu misses (%.1f%% kept open)\n",
+               hits, misses, 100.0 * hits / w[W_CARRIER_CHECKS]);
+    }
+    printf("commands %lu, relay pulses %lu\n", w[W_COMMANDS], w[W_PULSES]);
+    if (channels) {
+        printf("%-8s %10s %7s %10s\n", "channel", "rpd", "busy", "commands");
+    }
+    for (int i = 0; i < channels; i++) {
+        unsigned long samples = w[W_COUNT + i], busy = w[W_COUNT + channels + i];
+        if (channels == CHANNEL_LIST_COUNT) {
+            printf("%-8d", channel_list[i]);
+        } else {
+            printf("#%-7d", i);
+        }
+        printf(" %10lu %6.1f%% %10lu\n", samples, samples ? 100.0 * busy / samples : 0,
+               w[W_COUNT + 2 * channels + i]);
+    }
+    return 0;
+}
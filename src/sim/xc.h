@@ -0,0 +1,28 @@
+/*
+ * File:   xc.h
+ *
+ * Host stand-in for the XC8 compiler header. The delay and sleep
+ * intrinsics advance simulated time instead of burning cycles.
+ */
+
+#ifndef SIM_XC_H
+#define SIM_XC_H
+
+#include "pic16f1519.h"
+
+void sim_delay_cycles(unsigned long cycles);
+void sim_sleep(void);
+
+// XC8 computes the cycle count from _XTAL_FREQ at compile time,
+// so a delay is only correct while OSCCON matches _XTAL_FREQ.
+#define _delay(cycles) sim_delay_cycles(cycles)
+#define __delay_ms(x) _delay((unsigned long)((x) * (_XTAL_FREQ / 4000.0)))
+#define __delay_us(x) _delay((unsigned long)((x) * (_XTAL_FREQ / 4000000.0)))
+
+#define SLEEP() sim_sleep()
+#define NOP() sim_delay_cycles(1)
+#define CLRWDT()
+
+#define __interrupt()
+
+#endif
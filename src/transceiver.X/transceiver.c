@@ -10,12 +10,15 @@
  * A2 - CAPACITOR NEGATIVE
  * A3 - HBRIDGE 'N'
  * A4 - HBRIDGE '1'
+ * A5 - CAPACITOR SENSE (AN4, 1:2 divider from A0's node, see <CAPACITOR>)
  * B0 - IRQ INTERRUPT
+ * B1 - STATS DUMP REQUEST (stats builds, active low, weak pull-up)
  * D2 - LED OUT
- * C2 - BUTTON IN
+ * C2 - BUTTON IN (first target, see targets[])
  * C3 - SCL
  * C4 - SDI
  * C5 - SDO
+ * C6 - STATS TX (stats builds, EUSART)
  * E1 - TRANSMITTER CSN
  * E2 - TRANSMITTER CE
  */
@@ -30,19 +33,300 @@
 // MODES:
 // 0 - TX (transmitter)
 // 1 - RX (receiver)
+#ifndef mode
 #define mode 1
+#endif
+
+// ACK MODES:
+// 0 - blind burst, no CRC/auto-ack (the damaged prototype modules)
+// 1 - the switch auto-acknowledges commands and the remote
+//     stops its burst at the first ACK
+#ifndef ack_mode
+#define ack_mode 0
+#endif
+
+// COMMAND FRAMES (ack mode only): the message is a marker and the press's
+// sequence number, then the switch behind a group address it is for, if
+// any, and what to do (set the relay or recall a scene) instead of one
+// command character. The payload is only as long as that needs, with
+// its length in the packet (dynamic payload length). Group pipes keep a
+// fixed width, see <FRAMES>.
+#ifndef command_frames
+#define command_frames 1
+#endif
+#if ack_mode != 1
+#undef command_frames
+#define command_frames 0 // the length rides in Enhanced ShockBurst's header
+#endif
+#define frame_records 2 // one-byte records after the marker
+// this switch behind a group address (1-15), and the scenes (0-15) that
+// turn it on and off
+#ifndef device_unit
+#define device_unit 1
+#endif
+#define scenes_on 0x0001
+#define scenes_off 0x0002
+
+// the message is the command character and the press's sequence number
+// (see <DUPLICATES>), followed by the CRC; a frame is at most this long
+#if command_frames == 1
+#define message_length (1 + frame_records)
+#else
+#define message_length 2
+#endif
+
+// PAYLOAD FORMATS:
+// 0 - the command character repeated command_copies times, the sequence
+//     number and the CRC, the command decoded by counting matching
+//     bytes against correctness_threshold
+// 1 - forward error corrected: every nibble of the message goes out
+//     fec_copies times as an extended Hamming(8,4) codeword and the
+//     codewords are bit-interleaved across the payload (see <FEC>)
+#ifndef fec
+#define fec 1
+#endif
+// copies of each codeword, code rate is 1/(2*fec_copies)
+#ifndef fec_copies
+#define fec_copies 2
+#endif
+// how many times format 0 repeats the command character
+#define command_copies 1
+
+// software CRC-16 on the message, checked before the relay is touched
+// (the nRF's own CRC stays off for the damaged modules)
+#ifndef crc
+#define crc 1
+#endif
+// CRC IMPLEMENTATIONS (costs in <CRC>):
+// 0 - bitwise
+// 1 - 256-entry lookup table
+#ifndef crc_table
+#define crc_table 1
+#endif
+#define crc_length (2 * crc)
+
+// message bytes carried by the FEC payload
+#define fec_message_length (message_length + crc_length)
+// payload bytes for length of them
+#define fec_width(length) (2 * (length) * fec_copies)
 
-// how long the transmitted/received message is
-#define receive_length 1
+// how long the transmitted/received message is (the longest one, with
+// command_frames)
+#if fec == 1
+#define receive_length fec_width(fec_message_length)
+#elif command_frames == 1
+#define receive_length (message_length + crc_length)
+#else
+#define receive_length (command_copies + message_length - 1 + crc_length)
+#endif
 // how many bytes need to be correct from the received message
 #define correctness_threshold 1
 
-// how long to recharge the voltage doubling capacitor
-#define recharge_ms 50
+// sequence numbers of this many recent presses are remembered...
+#define dedup_cache_size 4
+// ...until nothing has been heard for this long
+#define dedup_hold_ms 1000
+
+// how long to drive the relay coil
+#define pulse_ms 50
+// the voltage doubling capacitor is charged until the ADC reads it at
+// this share of VDD (see <CAPACITOR>)...
+#define cap_target_percent 95
+// ...or until this runs out, after a pulse or before one...
+#define recharge_timeout_ms 100
+// ...or at power-up
+#define boot_charge_timeout_ms 500
+// how often the charge is checked
+#define cap_poll_ms 2
+// keep the side the relay was last pulsed to in High-Endurance Flash
+// and skip commands for the side it is already on
+#ifndef relay_latch
+#define relay_latch 1
+#endif
+
+// blind burst length in nrf_transmit() calls, ~200 ms either way
+// (longer FEC payloads take longer to load and to send). burst_gap_us
+// pads each call at the slow clock back to what it took at 8 MHz, a
+// faster loop only catches the nRF idle more often and sends more.
+#if fec == 1
+#define burst_length 1055
+#define burst_gap_us 85
+#elif crc == 1
+#define burst_length 2985
+#define burst_gap_us 20
+#else
+#define burst_length 4085
+#define burst_gap_us 15
+#endif
+// TX PAYLOAD REUSE:
+// 0 - every packet of a burst is loaded over SPI and sent with a CE pulse
+// 1 - the payload goes over SPI once per press and the nRF sends it
+//     again from its TX FIFO: a blind burst holds CE up under
+//     REUSE_TX_PL for burst_chunk packets back to back at a time, for
+//     burst_ms; an acknowledged one pulses CE again after a MAX_RT. The
+//     MCU sleeps until the IRQ either way, see nrf_burst().
+#ifndef tx_reuse
+#define tx_reuse 1
+#endif
+#define burst_ms 200
+// between chunks the nRF idles in standby for up to a Timer1 tick, which
+// still leaves a whole packet in every 1 ms listen window (and keeps it
+// well within the 4 ms it may stay in TX mode)
+#define burst_chunk 2
+#if burst_chunk < 2
+#error // CE goes down while the chunk's last packet is under way
+#endif
+// a blind packet (preamble, address and payload at rate_home), and as
+// many as go out in burst_ms: chunks of TX settling, burst_chunk packets
+// and a Timer1 tick (reloading Timer1 that often holds its count back)
+#define burst_packet_us ((6 + receive_length) * 8 * (rate_home == 0 ? 4 : 1) / (rate_home == 2 ? 2 : 1))
+#define burst_packets (burst_ms * 1000UL / (130 + burst_chunk * burst_packet_us + 1000000UL / timer1_ticks_per_s) * burst_chunk)
+// acknowledged burst: attempts of up to 16 transmissions (~5 ms) each,
+// enough to span the switch's listen period
+#define ack_attempts 40
+// longest the remote sleeps for an IRQ: a whole attempt at 250 kbps
+// (~25 ms), after that the nRF is taken for gone and the burst ends
+#define nrf_irq_timeout_ms 30
+// WAKE SYNC (ack mode only): the switch's ACKs carry its Timer1 clock
+// and the remote aims later presses at the switch's next window instead
+// of sending until one hears it, see <WAKE SYNC>
+#ifndef wake_sync
+#define wake_sync 1
+#endif
+#if ack_mode != 1
+#undef wake_sync
+#define wake_sync 0 // nothing comes back from a blind burst
+#endif
+// LFINTOSC runs Timer1 on both ends and is only good to +-15%, so the
+// remote measures the switch's against its own; after that the two
+// drift apart by up to this much (temperature over the seconds between
+// presses, and a tick either way on the measurement)
+#define sync_drift_ppm 500
+// the remote sleeps between presses and looks at its buttons this often,
+// a press counts once two looks in a row find it down
+#define button_poll_ms 25
+
+// RX listen schedule (see the listen governor below)
+// periods longer than the remote's burst (~200 ms) will miss presses
+#define listen_normal_ms 125 // wake period while the link is in use
+#define listen_fast_ms 50 // wake period right after a command...
+#define listen_fast_hold_s 30 // ...for this long
+#define listen_idle_ms 180 // wake period once the link has been quiet...
+#define listen_idle_after_s 7200 // ...for this long
+#define listen_window_ms 1 // how long each RX window stays open
+// NRF BETWEEN WINDOWS:
+// 0 - Standby-I (22 uA)
+// 1 - powered down (0.9 uA), woken nrf_startup_us before each window
+#ifndef rx_power_down
+#define rx_power_down 1
+#endif
+#define nrf_startup_us 1750 // Tpd2stby (1.5 ms) and LFINTOSC's 15% on top
+
+// BATTERY (two AA cells): VDD is measured at power-up and then every
+// battery_check_wakeups listen wake-ups (~10 minutes)...
+#ifndef battery_check_wakeups
+#define battery_check_wakeups 4800
+#endif
+// ...and below these the switch saves what it can and drives the relay
+// harder, see <BATTERY>
+#define battery_low_mv 2400
+#define battery_empty_mv 2100
+#define battery_hysteresis_mv 50 // stepping back up takes this much more
+#define battery_blink_ms 60 // low-battery blinks after a command
+
+// ADDRESSES (5 bytes each):
+// the switch answers on its own address (pipe 0) and on up to 5 group
+// addresses (pipes 1-5). The nRF only compares the first byte on pipes
+// 2-5 and takes the other 4 from pipe 1, so groups differ in their
+// first byte. The remote's addresses are in targets[] below.
+#ifndef device_address
+#define device_address "test1"
+#endif
+#ifndef group_count
+#define group_count 0
+#endif
+#define group_address "1room" // pipe 1
+#define group_heads "2345" // first bytes for pipes 2-5
+#if group_count > 5
+#error // only pipes 1-5 are left for groups
+#endif
+
+// CHANNELS (2400 + n MHz): the first one is home, the link starts there.
+// With channel_select 1 the switch samples the RPD of the others between
+// windows, moves to the quietest and tells the remote in its ACKs. With
+// 2 it hops to the next one in hop_sequence at every wake-up and the
+// ACKs say where in it the switch is. Away from home it listens there
+// too every home_every wake-ups, and a remote that gets no ACK tries
+// home for that long, see <CHANNELS>.
+// 25 and 50 sit between Wi-Fi channels 1, 6 and 11.
+#define channel_list 2, 25, 50, 75, 80
+#define channel_home 2
+#ifndef channel_select
+#define channel_select 1
+#endif
+#if wake_sync != 1 || group_count > 0
+#undef channel_select
+#define channel_select 0 // no ACKs to announce it in, or groups share it
+#endif
+#define home_every (channel_select == 2 ? 4 : 16)
+
+// DATA RATE: rate_home is the one the link starts at and a lost remote
+// falls back to on home: 0 = 250 kbps for range, 1 = 1 Mbps, 2 = 2 Mbps.
+// With rate_select (and channel_select 1) the switch steps up from there
+// while commands come in strong and back when they don't, tells the
+// remote in its ACKs and keeps the agreed rate in the HEF log.
+#ifndef rate_home
+#define rate_home 1
+#endif
+#ifndef rate_select
+#define rate_select 1
+#endif
+#if channel_select != 1
+#undef rate_select
+#define rate_select 0 // a lost remote finds it in the home windows
+#endif
+// RF_SETUP RF_DR_LOW/RF_DR_HIGH, and an ARD the ACK payload fits in
+#define rate_bits(r) ((r) == 0 ? 0x20 : (r) == 2 ? 0x08 : 0x00)
+#define rate_retr(r) ((r) == 0 ? 0x2F : 0x0F) // 750 us at 250 kbps, 250 us
+// a 250 kbps packet takes most of a 1 ms window by itself
+#define rate_window_ms(r) ((r) == 0 ? 3 * listen_window_ms : listen_window_ms)
+
+// CARRIER DETECT: with carrier_detect each window opens just long enough
+// for the RPD to see one of the remote's packets on air and only stays
+// open the full rate_window_ms if it did. The RPD only trips over
+// -64 dBm, so a command that comes in without it turns the short
+// windows off until carrier_confirm strong ones in a row, see
+// <CARRIER DETECT>.
+#ifndef carrier_detect
+#define carrier_detect 1
+#endif
+#define carrier_confirm 4
+
+// bytes of ACK payload: the switch's clock, then its channel or hop, then
+// its rate
+#define ack_payload_length (rate_select == 1 ? 6 : channel_select > 0 ? 5 : 4)
+
+// read the nRF registers back after setup and rewrite any that didn't stick
+#ifndef nrf_verify
+#define nrf_verify 1
+#endif
+// how long to wait for the nRF to answer over SPI at power-up
+#define nrf_ready_timeout_ms 100
+
+// run at 16 MHz and drop to 500 kHz while busy-waiting, see <CLOCK>
+#ifndef clock_switching
+#define clock_switching 1
+#endif
+
+// count where the switch's time goes and dump it over the EUSART (TX on
+// RC6, 9600 baud) whenever RB1 is pulled low, see <STATS>
+#ifndef stats
+#define stats 0
+#endif
 
 /* <DEFINITIONS> */
 
-#define _XTAL_FREQ 8000000 // 8 MHz
+#define _XTAL_FREQ 16000000 // 16 MHz, the fast clock (see <CLOCK>)
 #pragma config WDTE=OFF // turn off watchdog timer
 
 #define byte unsigned char
@@ -59,13 +343,49 @@
 #define LATCSN LATEbits.LATE1
 #define LATCE LATEbits.LATE2
 
-// TX mode - what state to send next (CHAR_ON or CHAR_OFF)
-char out = 1;
+#if mode == 0
+// Every button on the remote drives one switch address, which can be a
+// group address. out[] keeps the state to send next per target.
+typedef struct {
+    byte address[5];
+    byte button; // PORTC bit the button is on
+    #if command_frames == 1
+        byte unit; // 0, or the device_unit of one switch behind a group address
+        byte scene; // 0 to toggle, or 1 + the scene to recall
+    #endif
+} target;
+
+const target targets[] = {
+    { "test1", 2 }, // C2
+};
+#define target_count (sizeof(targets) / sizeof(targets[0]))
+
+// TX mode - what state to send next (CHAR_ON or CHAR_OFF), per target
+char out[target_count];
+#endif
+
+const byte channel_table[] = { channel_list };
+#define channel_count (sizeof(channel_table) / sizeof(channel_table[0]))
+
+#if channel_select == 2
+// channel_table index for each wake-up: home every home_every-th, the
+// others shuffled so no two in a row are the same or 5 MHz apart. A
+// byte counts wake-ups, so hop_length has to divide 256.
+#define hop_length 16
+const byte hop_sequence[hop_length] = {
+    0, 3, 2, 4, 0, 3, 2, 1, 0, 4, 1, 2, 0, 3, 1, 4
+};
+#if 256 % hop_length != 0
+#error
+#endif
+#endif
 
-char receive_buffer[receive_length];
 #if receive_length > 32 // cannot transmit more than 32 bytes at a time
 #error
 #endif
+#if fec == 1 && fec_copies < 1
+#error
+#endif
 
 // printable antipodal characters
 // (their sum is 0b01111111)
@@ -74,13 +394,431 @@ char receive_buffer[receive_length];
 
 /* <CODE> */
 
+/* <CLOCK> */
+
+// The MCU runs on HFINTOSC at its top 16 MHz, where an instruction
+// costs the least charge. Waiting doesn't end any sooner at a fast
+// clock, so busy-waits drop to MFINTOSC at 500 kHz (about a tenth of
+// the current) and come back. __delay_*() count cycles at _XTAL_FREQ,
+// clock_wait_us() at whichever clock it runs on. Timer1 runs on
+// LFINTOSC either way; Timer0, the ADC and the EUSART are set for
+// 16 MHz.
+#define clock_slow_hz 500000
+#define osccon_fast 0b01111010 // HFINTOSC 16 MHz, internal oscillator
+#define osccon_slow 0b00111010 // MFINTOSC 500 kHz, internal oscillator
+
+void clock_fast() {
+    OSCCON = osccon_fast;
+    while (!OSCSTATbits.HFIOFR) {} // HFINTOSC is off below 1 MHz
+}
+
+void clock_slow() {
+    OSCCON = osccon_slow;
+}
+
+#if clock_switching == 1
+#define clock_wait_us(us) do { \
+        clock_slow(); \
+        _delay((unsigned long)((us) * (clock_slow_hz / 4000000.0))); \
+        clock_fast(); \
+    } while (0)
+#else
+#define clock_wait_us(us) __delay_us(us)
+#endif
+
+#if crc == 1
+/* <CRC> */
+
+// CRC-16/CCITT-FALSE (polynomial 0x1021, initial value 0xFFFF), sent
+// high byte first after the data it covers. Rough costs on the
+// enhanced mid-range core, counted per data byte:
+// bitwise - ~100 cycles (~25 us at 16 MHz)
+// table   - ~25 cycles (~6 us) for 512 bytes of flash
+#if crc_table == 1
+const unsigned int crc_lookup[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+    0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+    0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+    0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+    0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+    0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+    0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+    0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+    0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+    0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+    0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+    0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+    0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+    0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+    0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+    0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+    0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+    0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+    0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+    0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+    0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+    0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0,
+};
+#endif
+
+unsigned int crc16(const byte *data, byte length) {
+    unsigned int sum = 0xFFFF;
+    for (byte i = 0; i < length; i++) {
+        #if crc_table == 1
+            sum = (sum << 8) ^ crc_lookup[(byte)(sum >> 8) ^ data[i]];
+        #else
+            sum ^= (unsigned int)data[i] << 8;
+            for (byte b = 0; b < 8; b++) {
+                if (sum & 0x8000) {
+                    sum = (sum << 1) ^ 0x1021;
+                } else {
+                    sum <<= 1;
+                }
+            }
+        #endif
+    }
+    return sum;
+}
+
+#if mode == 0
+// write the CRC of the first length bytes right after them
+void crc_append(byte *data, byte length) {
+    unsigned int sum = crc16(data, length);
+    data[length] = sum >> 8;
+    data[length + 1] = sum & 0xFF;
+}
+#endif
+
+#if mode == 1
+// longest crc_valid() so far in Timer0 ticks (see isr_tick_us)
+byte crc_worst = 0;
+
+// check the CRC that follows the first length bytes
+byte crc_valid(const byte *data, byte length) {
+    byte gie = INTCONbits.GIE; // callers may have interrupts masked
+    INTCONbits.GIE = 0; // the interrupt handler restarts Timer0
+    TMR0 = 0;
+    INTCONbits.TMR0IF = 0;
+    unsigned int sum = crc16(data, length);
+    byte took = INTCONbits.TMR0IF ? 255 : TMR0;
+    INTCONbits.GIE = gie;
+    if (took > crc_worst) {
+        crc_worst = took;
+    }
+    return data[length] == (byte)(sum >> 8) && data[length + 1] == (byte)sum;
+}
+#endif
+#else
+#define crc_valid(data, length) 1
+#endif
+
+#if fec == 1
+/* <FEC> */
+
+// extended Hamming(8,4): data in bits 3-0, parity bits 6-4
+// (d0^d1^d3, d0^d2^d3, d1^d2^d3) and overall parity in bit 7
+const byte fec_encode_table[16] = {
+    0x00, 0xB1, 0xD2, 0x63, 0xE4, 0x55, 0x36, 0x87, 0x78, 0xC9, 0xAA, 0x1B, 0x9C, 0x2D, 0x4E, 0xFF
+};
+
+// received byte -> data nibble, or fec_invalid for two flipped bits
+// (the codewords are 4 bits apart, so one flipped bit is corrected)
+#define fec_invalid 0x10
+const byte fec_decode_table[256] = {
+    0x00, 0x00, 0x00, 0x10, 0x00, 0x10, 0x10, 0x07, 0x00, 0x10, 0x10, 0x0B, 0x10, 0x0D, 0x0E, 0x10,
+    0x00, 0x10, 0x10, 0x0B, 0x10, 0x05, 0x06, 0x10, 0x10, 0x0B, 0x0B, 0x0B, 0x0C, 0x10, 0x10, 0x0B,
+    0x00, 0x10, 0x10, 0x03, 0x10, 0x0D, 0x06, 0x10, 0x10, 0x0D, 0x0A, 0x10, 0x0D, 0x0D, 0x10, 0x0D,
+    0x10, 0x01, 0x06, 0x10, 0x06, 0x10, 0x06, 0x06, 0x08, 0x10, 0x10, 0x0B, 0x10, 0x0D, 0x06, 0x10,
+    0x00, 0x10, 0x10, 0x03, 0x10, 0x05, 0x0E, 0x10, 0x10, 0x09, 0x0E, 0x10, 0x0E, 0x10, 0x0E, 0x0E,
+    0x10, 0x05, 0x02, 0x10, 0x05, 0x05, 0x10, 0x05, 0x08, 0x10, 0x10, 0x0B, 0x10, 0x05, 0x0E, 0x10,
+    0x10, 0x03, 0x03, 0x03, 0x04, 0x10, 0x10, 0x03, 0x08, 0x10, 0x10, 0x03, 0x10, 0x0D, 0x0E, 0x10,
+    0x08, 0x10, 0x10, 0x03, 0x10, 0x05, 0x06, 0x10, 0x08, 0x08, 0x08, 0x10, 0x08, 0x10, 0x10, 0x0F,
+    0x00, 0x10, 0x10, 0x07, 0x10, 0x07, 0x07, 0x07, 0x10, 0x09, 0x0A, 0x10, 0x0C, 0x10, 0x10, 0x07,
+    0x10, 0x01, 0x02, 0x10, 0x0C, 0x10, 0x10, 0x07, 0x0C, 0x10, 0x10, 0x0B, 0x0C, 0x0C, 0x0C, 0x10,
+    0x10, 0x01, 0x0A, 0x10, 0x04, 0x10, 0x10, 0x07, 0x0A, 0x10, 0x0A, 0x0A, 0x10, 0x0D, 0x0A, 0x10,
+    0x01, 0x01, 0x10, 0x01, 0x10, 0x01, 0x06, 0x10, 0x10, 0x01, 0x0A, 0x10, 0x0C, 0x10, 0x10, 0x0F,
+    0x10, 0x09, 0x02, 0x10, 0x04, 0x10, 0x10, 0x07, 0x09, 0x09, 0x10, 0x09, 0x10, 0x09, 0x0E, 0x10,
+    0x02, 0x10, 0x02, 0x02, 0x10, 0x05, 0x02, 0x10, 0x10, 0x09, 0x02, 0x10, 0x0C, 0x10, 0x10, 0x0F,
+    0x04, 0x10, 0x10, 0x03, 0x04, 0x04, 0x04, 0x10, 0x10, 0x09, 0x0A, 0x10, 0x04, 0x10, 0x10, 0x0F,
+    0x10, 0x01, 0x02, 0x10, 0x04, 0x10, 0x10, 0x0F, 0x08, 0x10, 0x10, 0x0F, 0x10, 0x0F, 0x0F, 0x0F,
+};
+
+// The message (length bytes) is split into nibbles, high nibble first,
+// and sent fec_copies times over. Codeword c bit b travels as payload
+// bit b * width + c, width being fec_width(length), so a corrupted byte
+// costs each codeword at most one bit.
+
+#if mode == 0
+void fec_encode(const byte *message, byte length, byte *payload) {
+    byte width = fec_width(length);
+    byte nibbles = 2 * length;
+    for (byte i = 0; i < width; i++) {
+        payload[i] = 0;
+    }
+    byte c = 0; // codeword
+    byte b = 0; // its bit
+    for (unsigned int i = 0; i < width * 8; i++) {
+        byte n = c % nibbles;
+        byte nibble = n & 1 ? message[n >> 1] & 0x0F : message[n >> 1] >> 4;
+        if (fec_encode_table[nibble] & (1 << b)) {
+            payload[i >> 3] |= 1 << (i & 7);
+        }
+        if (++c == width) {
+            c = 0;
+            b++;
+        }
+    }
+}
+#endif
+
+#if mode == 1
+// returns 1 if every nibble has a majority among its decodable copies
+byte fec_decode(const byte *payload, byte length, byte *message) {
+    byte width = fec_width(length);
+    byte nibbles = 2 * length;
+    byte codewords[receive_length];
+    for (byte i = 0; i < width; i++) {
+        codewords[i] = 0;
+    }
+    byte c = 0;
+    byte b = 0;
+    for (unsigned int i = 0; i < width * 8; i++) {
+        if (payload[i >> 3] & (1 << (i & 7))) {
+            codewords[c] |= 1 << b;
+        }
+        if (++c == width) {
+            c = 0;
+            b++;
+        }
+    }
+
+    for (byte n = 0; n < nibbles; n++) {
+        // majority vote (Boyer-Moore) over the copies that decode...
+        byte candidate = fec_invalid;
+        byte votes = 0;
+        for (byte i = n; i < width; i += nibbles) {
+            byte v = fec_decode_table[codewords[i]];
+            if (v == fec_invalid) {
+                continue;
+            }
+            if (votes == 0) {
+                candidate = v;
+                votes = 1;
+            } else if (v == candidate) {
+                votes++;
+            } else {
+                votes--;
+            }
+        }
+        // ...and check the candidate really has more than half of them
+        byte agree = 0;
+        byte valid = 0;
+        for (byte i = n; i < width; i += nibbles) {
+            byte v = fec_decode_table[codewords[i]];
+            if (v != fec_invalid) {
+                valid++;
+                agree += v == candidate;
+            }
+        }
+        if (agree * 2 <= valid) {
+            return 0;
+        }
+        if (n & 1) {
+            message[n >> 1] |= candidate;
+        } else {
+            message[n >> 1] = candidate << 4;
+        }
+    }
+    return 1;
+}
+#endif
+#endif
+
+#if command_frames == 1
+/* <FRAMES> */
+
+// A frame is FRAME_MARK with the low nibble of the press's sequence
+// number, then one-byte records, the operation in the high nibble and
+// its argument in the low one, and the CRC. No command character has
+// FRAME_MARK's high nibble, so a remote still sending command characters
+// can't pass for a frame. A FRAME_TARGET first picks one switch behind a
+// group address, without it every switch that hears the frame acts on
+// it; then comes one FRAME_SET or FRAME_SCENE. Dynamic payload length
+// needs auto-ack, which groups don't get, so with groups every frame is
+// padded with FRAME_NOP to the fixed width of their pipes.
+#define FRAME_MARK 0xA0 // | sequence & 0x0F, first byte of every frame
+#define FRAME_NOP 0x00
+#define FRAME_SET 0x10 // | 1 on, | 0 off
+#define FRAME_TARGET 0x20 // | device_unit
+#define FRAME_SCENE 0x30 // | scene, on or off as scenes_on/scenes_off say
+
+#if mode == 0
+// the frame for a press of target t, returns the payload width
+byte frame_encode(byte t, byte sequence, byte *payload) {
+    #if fec == 1
+        byte message[fec_message_length];
+    #else
+        byte *message = payload;
+    #endif
+    byte length = 0;
+    message[length++] = FRAME_MARK | (sequence & 0x0F);
+    if (targets[t].unit) {
+        message[length++] = FRAME_TARGET | targets[t].unit;
+    }
+    if (targets[t].scene) {
+        message[length++] = FRAME_SCENE | (targets[t].scene - 1);
+    } else {
+        message[length++] = FRAME_SET | out[t];
+    }
+    #if group_count > 0
+        while (length < message_length) {
+            message[length++] = FRAME_NOP;
+        }
+    #endif
+    #if crc == 1
+        crc_append(message, length);
+        length += crc_length;
+    #endif
+    #if fec == 1
+        fec_encode(message, length, payload);
+        return fec_width(length);
+    #else
+        return length;
+    #endif
+}
+#endif
+
+#if mode == 1
+#define CHAR_SKIP '-' // a good frame with nothing for this switch
+
+// what a width-byte frame asks of this switch: CHAR_ON/CHAR_OFF or
+// CHAR_SKIP, 0 if it doesn't decode
+char frame_decode(const byte *payload, byte width, byte *sequence) {
+    #if fec == 1
+        byte length = width / (2 * fec_copies);
+        byte message[fec_message_length];
+        if (fec_width(length) != width) {
+            return 0;
+        }
+    #else
+        byte length = width;
+        const byte *message = payload;
+    #endif
+    // the marker and sequence number and at least the command
+    if (length < 2 + crc_length || length > fec_message_length) {
+        return 0;
+    }
+    #if fec == 1
+        if (!fec_decode(payload, length, message)) {
+            return 0;
+        }
+    #endif
+    length -= crc_length;
+    if (!crc_valid(message, length)) {
+        return 0;
+    }
+    if ((message[0] & 0xF0) != FRAME_MARK) {
+        return 0;
+    }
+    *sequence = message[0] & 0x0F;
+    byte i = 1;
+    byte mine = 1;
+    if ((message[i] & 0xF0) == FRAME_TARGET) {
+        mine = (message[i] & 0x0F) == device_unit;
+        i++;
+    }
+    // the command, then nothing but padding
+    for (byte j = i + 1; j < length; j++) {
+        if (message[j] != FRAME_NOP) {
+            return 0;
+        }
+    }
+    if (i >= length) {
+        return 0;
+    }
+    byte arg = message[i] & 0x0F;
+    switch (message[i] & 0xF0) {
+        case FRAME_SET:
+            break;
+        case FRAME_SCENE:
+            if ((unsigned int)scenes_on >> arg & 1) {
+                arg = 1;
+            } else if ((unsigned int)scenes_off >> arg & 1) {
+                arg = 0;
+            } else {
+                mine = 0; // a scene this switch isn't in
+            }
+            break;
+        default:
+            return 0;
+    }
+    if (!mine) {
+        return CHAR_SKIP;
+    }
+    return arg ? CHAR_ON : CHAR_OFF;
+}
+#endif
+#endif
+
 #if mode == 1
-void capacitor_recharge() {
+/* <CAPACITOR> */
+
+// RA5/AN4 sees the capacitor through a 1:2 divider (the node swings to
+// twice VDD during a pulse) with VDD as the ADC reference, so a
+// capacitor charged all the way reads cap_full_reading whatever the
+// battery voltage. The ADC is only on for the reading.
+//
+// Boards from before the sense input need the divider added: two equal
+// resistors (470 kohm each, so it leaks ~3 uA) from the capacitor's
+// positive side to ground with RA5 on the tap, and 1 nF from RA5 to
+// ground to charge the ADC's sampling capacitor from. That is a time
+// constant of ~0.24 ms, so the tap has settled by the next cap_poll_ms.
+#define cap_sense_channel 4
+#define cap_full_reading 128 // of 256, left-justified ADRESH
+#define cap_target_reading (cap_full_reading * cap_target_percent / 100)
+#define cap_timeout_polls (recharge_timeout_ms / cap_poll_ms)
+#if cap_timeout_polls > 255
+#error // cap.polls is 8 bits wide
+#endif
+
+struct {
+    byte target; // reading a charge stops at...
+    byte timeout_polls; // ...or after this many checks, see <BATTERY>
+    byte polls; // checks so far in the running charge
+    byte last; // last reading
+    unsigned long timeouts; // charges that gave up short of the target
+} cap = { cap_target_reading, cap_timeout_polls, 0, 0, 0 };
+
+void cap_sense_setup() {
+    TRISAbits.TRISA5 = 1;
+    ANSELAbits.ANSA5 = 1; // analog input
+    ADCON1 = 0b00100000; // left-justified, Fosc/32 (2 us TAD), VDD/VSS
+}
+
+byte cap_charged() {
+    ADCON0 = cap_sense_channel << 2 | 0x01; // select the channel, ADC on
+    __delay_us(5); // acquisition
+    ADCON0bits.GO_nDONE = 1;
+    while (ADCON0bits.GO_nDONE) {}
+    ADCON0 = 0; // ADC off
+    cap.last = ADRESH;
+    return cap.last >= cap.target;
+}
+
+void cap_charge() {
+    nCAPEN = !0;
     nCAPPO = !1;
     CAPNEG = 1;
-    __delay_ms(recharge_ms);
-    nCAPPO = !0;
-    CAPNEG = 0;
 }
 
 void relay_reset() {
@@ -92,57 +830,199 @@ void relay_reset() {
 }
 
 void relay_setup() {
-    // set all pins to output
+    // set all pins to output, but the capacitor sense input
     TRISA = 0;
+    cap_sense_setup();
     // disable H-bridge
     HBRN = 0;
     HBR1 = 0;
-    // charge capacitor
-    nCAPEN = !0;
-    CAPNEG = 1;
-    nCAPPO = !1;
-    __delay_ms(500);
-    CAPNEG = 0;
-    nCAPPO = !0;
+    // charge capacitor until it's full or the timeout runs out
+    cap_charge();
+    for (unsigned int t = 0; t < boot_charge_timeout_ms && !cap_charged(); t += cap_poll_ms) {
+        clock_wait_us(cap_poll_ms * 1000UL);
+    }
+    relay_reset();
 }
+#endif
 
-void relay_n() {
-    relay_reset();
-    nCAPEN = !1;
-    HBRN = 1;
-    __delay_ms(50);
-    HBRN = 0;
-    nCAPEN = !0;
-    capacitor_recharge();
-    relay_reset();
+#if mode == 0
+#undef stats
+#define stats 0 // the remote doesn't keep any
+#endif
+
+#if stats == 1
+/* <STATS> */
+
+// Timer1 ticks spent in each state (they overlap: the MCU sleeps
+// through most of a relay pulse), Timer0 ticks spent in interrupts and
+// event counts. Everything the interrupt handler counts is only written
+// there. stats_dump() takes a copy that the TX interrupt sends as 32-bit
+// little-endian words, in the order of the struct, and
+// src/sim/stats_decode.c turns a dump into uAh/day. LFINTOSC (the Timer1 clock) is only good to +-15%.
+#define STAT_SLEEP 0
+#define STAT_RX 1 // RX window open
+#define STAT_PULSE 2 // relay coil driven
+#define STAT_CHARGE 3 // doubling capacitor charging
+#define STAT_LED 4 // LED lit
+#define stat_count 5
+#define stats_version 1
+// build options the decoder needs, in stat.flags
+#define STATS_RX_POWER_DOWN 0x01 // the nRF is down between windows
+#define stats_flags (rx_power_down == 1 ? STATS_RX_POWER_DOWN : 0)
+
+struct {
+    unsigned long total; // Timer1 ticks since timer1_setup()
+    unsigned long ticks[stat_count]; // Timer1 ticks per state
+    unsigned long isr_ticks; // Timer0 ticks (1 us) in the interrupt handler
+    unsigned long interrupts;
+    unsigned long spi_bytes;
+    unsigned long windows; // RX windows opened
+    unsigned long empty_windows; // ...that closed with nothing received
+    unsigned long pulses;
+    unsigned long commands; // new commands acted on
+    unsigned long carrier_checks; // windows opened short, see <CARRIER DETECT>
+    unsigned long carrier_hits; // ...that the RPD kept open
+    unsigned long flags; // stats_flags, set by stats_dump()
+    #if channel_select > 0
+        // per channel_table entry, see <CHANNELS>
+        unsigned long rpd_samples[channel_count];
+        unsigned long rpd_busy[channel_count]; // samples that found a carrier
+        unsigned long channel_commands[channel_count];
+    #endif
+} stat;
+unsigned long stat_since[stat_count]; // when each running state began
+byte stat_running = 0; // one bit per state
+
+#define stat_words (sizeof(stat) / sizeof(unsigned long))
+#define dump_length (4 + 4 * stat_words + 1) // header, words, checksum
+
+// the dump going out, one byte per TX interrupt
+struct {
+    unsigned long words[stat_words];
+    byte pos; // bytes handed to the EUSART, 0 when there is no dump
+    byte sum;
+} dump;
+
+#define stats_add(field, n) (stat.field += (n))
+#define stats_sending (dump.pos != 0) // the EUSART stops in sleep
+#else
+#define stats_add(field, n)
+#define stats_start(state)
+#define stats_stop(state)
+#define stats_sending 0
+#endif
+
+/* <SPI ENGINE> */
+
+// Transactions are queued and clocked out by the SSP interrupt, one
+// byte per interrupt, with CSN framed around each of them. Interrupts
+// stay enabled the whole time. The SSP stops in sleep (we're the master),
+// so queued transfers must finish before SLEEP().
+#define spi_queue_length 4
+
+typedef struct {
+    byte command;
+    byte length; // data bytes after the command
+    const byte *tx; // data to send, 0 sends 0xFF
+    byte *rx; // where to put the bytes read back, 0 drops them
+    void (*callback)(void); // called from the interrupt when done, or 0
+    volatile byte done;
+    byte status; // STATUS, clocked out with the command
+} spi_transaction;
+
+spi_transaction spi_queue[spi_queue_length];
+volatile byte spi_head = 0; // transaction on the wire
+volatile byte spi_tail = 0; // next free slot
+volatile byte spi_active = 0;
+byte spi_pos; // data bytes of the current transaction sent so far
+
+void spi_start() {
+    if (spi_head == spi_tail) {
+        spi_active = 0;
+        return;
+    }
+    spi_active = 1;
+    spi_pos = 0;
+    LATCSN = 0;
+    SSPBUF = spi_queue[spi_head].command;
 }
 
-void relay_1() {
-    relay_reset();
-    nCAPEN = !1;
-    HBR1 = 1;
-    __delay_ms(50);
-    HBR1 = 0;
-    nCAPEN = !0;
-    capacitor_recharge();
-    relay_reset();
+// called on SSPIF, once per byte
+void spi_interrupt() {
+    PIR1bits.SSPIF = 0;
+    stats_add(spi_bytes, 1);
+    spi_transaction *t = &spi_queue[spi_head];
+    byte data = SSPBUF; // also clears BF
+    if (spi_pos == 0) {
+        t->status = data;
+    } else if (t->rx) {
+        t->rx[spi_pos-1] = data;
+    }
+    if (spi_pos < t->length) {
+        SSPBUF = t->tx ? t->tx[spi_pos] : 0xFF;
+        spi_pos++;
+        return;
+    }
+    LATCSN = 1;
+    t->done = 1;
+    if (t->callback) {
+        t->callback();
+    }
+    spi_head = (spi_head + 1) % spi_queue_length;
+    spi_start();
 }
-#endif
 
-// CSN pin needs to be set to low before
-// this command and set high after you're done!
-byte writeSPIByte(byte data) {
-    // this function is non-reentrant so it shouldn't be interrupted
-    byte previousGIE = INTCONbits.GIE;
-    INTCONbits.GIE = 0;
+// wait for a transaction (or for queue space) to free up
+void spi_wait(spi_transaction *t) {
+    while (!t->done) {
+        // in an interrupt (or before int_setup) the SSP
+        // interrupt can't preempt us, so run it from here
+        if (!INTCONbits.GIE && PIR1bits.SSPIF) {
+            spi_interrupt();
+        }
+        NOP();
+    }
+}
+
+// queue a transaction; tx/rx must stay valid until it's done
+spi_transaction *spi_submit(byte command, const byte *tx, byte *rx, byte length,
+                            void (*callback)(void)) {
+    byte next = (spi_tail + 1) % spi_queue_length;
+    while (next == spi_head) { // full, wait for the oldest one
+        spi_wait(&spi_queue[spi_head]);
+    }
+    spi_transaction *t = &spi_queue[spi_tail];
+    t->command = command;
+    t->length = length;
+    t->tx = tx;
+    t->rx = rx;
+    t->callback = callback;
+    t->done = 0;
+
+    PIE1bits.SSPIE = 0; // only the SSP interrupt, not GIE
+    spi_tail = next;
+    if (!spi_active) {
+        spi_start();
+    }
+    PIE1bits.SSPIE = 1;
+    return t;
+}
 
-    SSPBUF = data; // put data to be transmitted in the FIFO buffer
-    SSPSTATbits.BF = 0; // set transmit/receiving to unfinished
-    while(SSPSTATbits.BF == 0){} // wait until transmit/receive is finished
+// queue a command and wait for it, returns STATUS
+byte nrf_command(byte command, const byte *tx, byte *rx, byte length) {
+    spi_transaction *t = spi_submit(command, tx, rx, length, 0);
+    spi_wait(t);
+    return t->status;
+}
+
+byte nrf_write(byte reg, byte value) {
+    return nrf_command(0x20 | reg, &value, 0, 1);
+}
 
-    byte result = SSPBUF;
-    INTCONbits.GIE = previousGIE;
-    return result;
+byte nrf_read(byte reg) {
+    byte value;
+    nrf_command(reg, 0, &value, 1);
+    return value;
 }
 
 void spi_setup() {
@@ -163,197 +1043,1560 @@ void spi_setup() {
 
     SSPCON1bits.SSPM = 0b0000; // SPI Master, clock = FOSC/4
 
-    PIE1bits.SSPIE = 0; // Disable SPI interrupt (for now)
+    PIR1bits.SSPIF = 0;
+    PIE1bits.SSPIE = 1; // transfers are driven by the SPI interrupt
+
+    SSPCON1bits.SSPEN = 1; // enable SPI
+}
+
+// CONFIG register value
+#if ack_mode == 1
+#define nrf_crc 0b00001100 // EN_CRC, 2 byte CRC (needed for auto-ack)
+#else
+#define nrf_crc 0b00000000
+#endif
+#if mode == 0
+#define nrf_config (nrf_crc | 0b00000000) // TX -> PTX, powered up for each burst
+#endif
+#if mode == 1
+// MASK_TX_DS: sending an ACK payload (wake_sync) sets TX_DS on the PRX
+// too, which would pull IRQ low with nothing received
+#if rx_power_down == 1
+#define nrf_config (nrf_crc | 0b00100001) // RX -> MASK_TX_DS, PRX, powered up per window
+#else
+#define nrf_config (nrf_crc | 0b00100011) // RX -> MASK_TX_DS, PWR_UP, PRX
+#endif
+#endif
+
+// FEATURE: EN_DPL for frames and ACK payloads, EN_ACK_PAY for the latter
+#define nrf_feature (wake_sync == 1 ? 0x06 : 0x04)
+
+// nRF register values, streamed out by nrf_setup() in this order
+typedef struct {
+    byte reg;
+    byte value;
+} nrf_register;
+
+const nrf_register nrf_registers[] = {
+    // auto-ack on pipe 0 in ack mode, disabled otherwise. It goes
+    // before CONFIG because auto-ack forces CRC to be enabled
+    { 0x01, ack_mode == 1 ? 0x01 : 0x00 }, // EN_AA
+    { 0x00, nrf_config }, // CONFIG
+    { 0x05, channel_home }, // RF_CH: frequency channel
+    { 0x04, ack_mode == 1 ? rate_retr(rate_home) : 0x00 }, // SETUP_RETR: 15 retries in ack mode
+    { 0x03, 0x03 }, // SETUP_AW: address width = 5
+    { 0x06, rate_bits(rate_home) | 0x06 }, // RF_SETUP: data rate, signal strength 0dBm
+    { 0x11, receive_length }, // RX_PW_P0: payload width for pipe 0
+    #if wake_sync == 1 || command_frames == 1
+        { 0x1D, nrf_feature }, // FEATURE
+        { 0x1C, 0x01 }, // DYNPD: pipe 0, on both ends
+    #endif
+    #if mode == 1
+        // own address and the groups; groups are never auto-acked,
+        // several switches answering at once would collide
+        { 0x02, (1 << (group_count + 1)) - 1 }, // EN_RXADDR
+        { 0x12, group_count >= 1 ? receive_length : 0 }, // RX_PW_P1
+        { 0x13, group_count >= 2 ? receive_length : 0 }, // RX_PW_P2
+        { 0x14, group_count >= 3 ? receive_length : 0 }, // RX_PW_P3
+        { 0x15, group_count >= 4 ? receive_length : 0 }, // RX_PW_P4
+        { 0x16, group_count >= 5 ? receive_length : 0 }, // RX_PW_P5
+    #endif
+};
+#define nrf_register_count (sizeof(nrf_registers) / sizeof(nrf_registers[0]))
+
+// address registers, written after the ones above
+typedef struct {
+    byte reg;
+    byte length;
+    const byte *value;
+} nrf_address;
+
+#if mode == 1
+const byte rx_address[5] = device_address;
+const byte rx_group_address[5] = group_address;
+const byte rx_group_heads[4] = group_heads;
+#endif
+
+// different addresses for TX and RX
+const nrf_address nrf_addresses[] = {
+    #if mode == 0
+        // the first target, target_select() switches to the others
+        { 0x10, 5, targets[0].address }, // TX_ADDR
+        #if ack_mode == 1
+            // ACKs come back on pipe 0, so it has to match TX_ADDR
+            { 0x0A, 5, targets[0].address }, // RX_ADDR_P0
+        #endif
+    #endif
+    #if mode == 1
+        { 0x0A, 5, rx_address }, // RX_ADDR_P0
+        #if group_count >= 1
+            { 0x0B, 5, rx_group_address }, // RX_ADDR_P1
+        #endif
+        #if group_count >= 2
+            { 0x0C, 1, &rx_group_heads[0] }, // RX_ADDR_P2
+        #endif
+        #if group_count >= 3
+            { 0x0D, 1, &rx_group_heads[1] }, // RX_ADDR_P3
+        #endif
+        #if group_count >= 4
+            { 0x0E, 1, &rx_group_heads[2] }, // RX_ADDR_P4
+        #endif
+        #if group_count >= 5
+            { 0x0F, 1, &rx_group_heads[3] }, // RX_ADDR_P5
+        #endif
+    #endif
+};
+#define nrf_address_count (sizeof(nrf_addresses) / sizeof(nrf_addresses[0]))
+
+// registers that didn't read back right (and were written again),
+// 0xFF if the nRF never answered
+byte nrf_setup_errors = 0;
+
+// poll STATUS until the nRF answers instead of waiting a fixed time
+byte nrf_wait_ready() {
+    for (unsigned int i = 0; i < nrf_ready_timeout_ms * 10; i++) {
+        // bit 7 of STATUS always reads 0, a floating MISO gives 0xFF
+        // and a missing chip 0x00
+        byte status = nrf_command(0xFF, 0, 0, 0); // NOP
+        if ((status & 0x80) == 0 && status != 0x00) {
+            return 1;
+        }
+        clock_wait_us(100);
+    }
+    return 0;
+}
+
+#if nrf_verify == 1
+// read every register back, write again whatever didn't stick
+byte nrf_check() {
+    byte errors = 0;
+    for (byte i = 0; i < nrf_register_count; i++) {
+        const nrf_register *r = &nrf_registers[i];
+        if (nrf_read(r->reg) != r->value) {
+            nrf_write(r->reg, r->value);
+            errors++;
+        }
+    }
+    for (byte i = 0; i < nrf_address_count; i++) {
+        const nrf_address *a = &nrf_addresses[i];
+        byte address[5];
+        nrf_command(a->reg, 0, address, a->length);
+        for (byte j = 0; j < a->length; j++) {
+            if (address[j] != a->value[j]) {
+                nrf_command(0x20 | a->reg, a->value, 0, a->length);
+                errors++;
+                break;
+            }
+        }
+    }
+    return errors;
+}
+#endif
+
+void nrf_setup() {
+    LATCE = 0; // enables receiving in RX mode and transmitting in TX mode
+    LATCSN = 1; // CSN is active-low, so set it high
+    if (!nrf_wait_ready()) {
+        nrf_setup_errors = 0xFF;
+        return;
+    }
+
+    // queue the whole table, the SPI interrupt clocks it out back to back
+    // (the switch's 1.5 ms oscillator start-up after PWR_UP is over long
+    // before its first CE pulse, the remote powers up for each burst)
+    spi_transaction *t;
+    for (byte i = 0; i < nrf_register_count; i++) {
+        t = spi_submit(0x20 | nrf_registers[i].reg, &nrf_registers[i].value, 0, 1, 0);
+    }
+    for (byte i = 0; i < nrf_address_count; i++) {
+        const nrf_address *a = &nrf_addresses[i];
+        t = spi_submit(0x20 | a->reg, a->value, 0, a->length, 0);
+    }
+    spi_wait(t);
+
+    #if wake_sync == 1 || command_frames == 1
+        // the nRF24L01 (not the +) ignores FEATURE and DYNPD until
+        // ACTIVATE, which toggles, so it only goes out if they didn't take
+        if (nrf_read(0x1D) != nrf_feature) {
+            byte key = 0x73;
+            nrf_command(0x50, &key, 0, 1); // ACTIVATE
+            nrf_write(0x1D, nrf_feature);
+            nrf_write(0x1C, 0x01);
+        }
+    #endif
+
+    #if nrf_verify == 1
+        nrf_setup_errors = nrf_check();
+    #endif
+}
+
+/* <EVENTS> */
+
+// The interrupt handler only records what happened and the main loop
+// does the work. Bit-fields compile to single BSF/BCF instructions,
+// so the main loop can clear them without masking interrupts.
+volatile struct {
+    unsigned irq : 1; // the nRF pulled IRQ low
+    unsigned timer1 : 1; // Timer1 overflowed
+    unsigned dump : 1; // RB1 pulled low for a stats dump
+} events;
+
+// Timer0 times each interrupt (it stops in sleep, but the handler never
+// sleeps). isr_worst is the longest one so far in Timer0 ticks,
+// 255 meaning 255 ticks or more. The handler takes a few us, under one
+// tick at 1:32, so with stats the prescaler is 1:4 for isr_ticks to
+// add up to something.
+#if stats == 1
+#define isr_tick_us 1 // Fosc/4 with a 1:4 prescaler
+#define timer0_ps 0b001
+#else
+#define isr_tick_us 8 // Fosc/4 with a 1:32 prescaler
+#define timer0_ps 0b100
+#endif
+byte isr_worst = 0;
+
+// configure interrupts (both internal and external)
+void int_setup() {
+    TRISBbits.TRISB0 = 1; // set INT pin to read (bruh)
+    ANSELBbits.ANSB0 = 0; // digital read
+
+    INTCONbits.GIE = 1; // global interrupt enable
+    INTCONbits.PEIE = 1; // enable interrupt from peripherals
+    //INTCONbits.INTE = 1; // interrupt enable
+    //OPTION_REGbits.INTEDG = 0; // falling edge detect
+    INTCONbits.IOCIE = 1; // interrupt on change enable
+    IOCBNbits.IOCBN0 = 1; // falling edge detect
+
+    OPTION_REGbits.TMR0CS = 0; // Timer0 runs on Fosc/4...
+    OPTION_REGbits.PSA = 0;
+    OPTION_REGbits.PS = timer0_ps; // ...prescaled to isr_tick_us
+
+    #if stats == 1
+        TRISBbits.TRISB1 = 1; // stats dump request, active low
+        ANSELBbits.ANSB1 = 0;
+        WPUB = 0b00000010; // with a weak pull-up
+        OPTION_REGbits.nWPUEN = 0;
+        IOCBNbits.IOCBN1 = 1;
+    #endif
+}
+
+// LFINTOSC (31 kHz) with a 1:8 prescaler
+#define timer1_ticks_per_s 3875
+// rounded up so a delay never comes out short
+#define timer1_ticks(ms) ((unsigned int)(((unsigned long)(ms) * timer1_ticks_per_s + 999) / 1000))
+#if listen_idle_ms > 16000 || listen_normal_ms > 16000 || listen_fast_ms > 16000
+#error // Timer1 can't count longer than ~16.9 seconds
+#endif
+
+/* <ONE-SHOT TIMERS> */
+
+// Timer1 keeps counting in sleep, so every delay the switch (and the
+// remote between presses) needs is a one-shot timer counted in Timer1
+// ticks and the main loop sleeps through it. Timer1 is always loaded to
+// overflow at the nearest one.
+#if mode == 0
+#define TIMER_BUTTON 0 // next look at the buttons
+#define TIMER_SYNC 1 // the switch's predicted window is coming up
+#define TIMER_BURST 2 // the blind burst's next chunk, or the deadline on an IRQ
+#define timer_count 3
+#endif
+#if mode == 1
+#define TIMER_LISTEN 0 // next RX window
+#define TIMER_WINDOW 1 // end of the open RX window
+#define TIMER_RELAY 2 // next step of the relay sequence
+#define TIMER_DEDUP 3 // forget the sequence numbers heard
+#define TIMER_LED 4 // next change of the low-battery blink
+#define TIMER_STARTUP 5 // the nRF is up, open the RX window
+#define timer_count 6
+#endif
+
+unsigned int timer_left[timer_count]; // ticks to go, 0 = stopped
+byte timer_fired = 0; // one bit per expired timer
+unsigned int timer1_loaded = 0; // ticks Timer1 was last loaded for
+unsigned long timer1_clock = 0; // ticks counted since timer1_setup()
+
+unsigned int timer1_read() {
+    byte high, low;
+    do { // Timer1 is asynchronous, TMR1L can carry mid-read
+        high = TMR1H;
+        low = TMR1L;
+    } while (high != TMR1H);
+    return (unsigned int)high << 8 | low;
+}
+
+// ticks since Timer1 was last loaded
+unsigned int timer1_elapsed() {
+    unsigned int count = timer1_read();
+    unsigned int start = 65536UL - timer1_loaded;
+    if (count >= start) { // not overflowed yet
+        return count - start;
+    }
+    return count + timer1_loaded; // overflowed and counting up from 0 again
+}
+
+// stop Timer1 and count the running timers down by what it has counted
+void timers_count() {
+    T1CONbits.TMR1ON = 0;
+    unsigned int elapsed = timer1_elapsed();
+    timer1_clock += elapsed;
+    stats_add(total, elapsed);
+    for (byte i = 0; i < timer_count; i++) {
+        if (timer_left[i] == 0) {
+            continue;
+        }
+        if (timer_left[i] <= elapsed) {
+            timer_left[i] = 0;
+            timer_fired |= 1 << i;
+        } else {
+            timer_left[i] -= elapsed;
+        }
+    }
+}
+
+// load Timer1 for the nearest deadline and restart it
+void timers_reload() {
+    unsigned int next = 0xFFFF;
+    for (byte i = 0; i < timer_count; i++) {
+        if (timer_left[i] && timer_left[i] < next) {
+            next = timer_left[i];
+        }
+    }
+    timer1_loaded = next;
+    next = 65536UL - next;
+    TMR1H = next >> 8;
+    TMR1L = next & 0xFF;
+    PIR1bits.TMR1IF = 0;
+    events.timer1 = 0;
+    T1CONbits.TMR1ON = 1;
+}
+
+// Timer1 ticks since timer1_setup(), the clock the wake sync runs on
+unsigned long timer1_now() {
+    return timer1_clock + timer1_elapsed();
+}
+
+void timers_run() {
+    timers_count();
+    timers_reload();
+}
+
+void timer_start(byte timer, unsigned int ticks) {
+    timers_count();
+    timer_left[timer] = ticks ? ticks : 1;
+    timers_reload();
+}
+
+void timer_stop(byte timer) {
+    // Timer1 may still overflow for it, timers_run() sorts that out
+    timer_left[timer] = 0;
+}
+
+// Timer0 is disabled during sleep so we use Timer1
+void timer1_setup() {
+    T1CONbits.T1CKPS1 = 1;   // bits 5-4  Prescaler Rate Select bits
+    T1CONbits.T1CKPS0 = 1;   // bit 4, 0b11 = 1:8
+    T1CONbits.T1OSCEN = 1;   // bit 3 Timer1 Oscillator Enable Control bit 1 = on
+    T1CONbits.nT1SYNC = 1;   // bit 2 Timer1 External Clock Input Synchronization Control bit...1 = Do not synchronize external clock input
+    T1CONbits.TMR1CS = 0b11; // bit 1 Timer1 Clock Source Select bit...0b11 = LFINTOSC
+
+    TMR1H = 0; // clear offset registers before enabling interrupts
+    TMR1L = 0;
+    PIR1bits.TMR1IF = 0;
+    PIE1bits.TMR1IE = 1; // enable Timer1 interrupts on overflow
+    T1CONbits.TMR1ON = 1; // bit 0 enables timer, the one-shots load it
+}
+
+#if stats == 1
+// Timer1 ticks since timer1_setup(), the clock for the stats states
+unsigned long stats_now() {
+    return stat.total + timer1_elapsed();
+}
+
+void stats_start(byte state) {
+    stat_since[state] = stats_now();
+    stat_running |= 1 << state;
+}
+
+void stats_stop(byte state) {
+    if (stat_running & 1 << state) {
+        stat.ticks[state] += stats_now() - stat_since[state];
+        stat_running &= ~(1 << state);
+    }
+}
+
+// 0xA5 0x5A, version, word count, the words, then a checksum byte that
+// makes the bytes after the header sum to 0. This takes the copy and
+// starts the EUSART; stats_dump_byte() sends it from the TX interrupt,
+// about 120 ms at 9600 baud, and stats_dump_end() stops the EUSART.
+void stats_dump() {
+    if (dump.pos) {
+        return; // one is still going out
+    }
+    timers_run(); // bring stat.total up to now
+    stat.flags = stats_flags;
+    byte gie = INTCONbits.GIE; // the handler writes some of them
+    INTCONbits.GIE = 0;
+    const unsigned long *words = &stat.total;
+    for (byte i = 0; i < stat_words; i++) {
+        dump.words[i] = words[i];
+    }
+    INTCONbits.GIE = gie;
+    dump.sum = 0;
+
+    SPBRGH = 1;
+    SPBRGL = 160; // 416: 16 MHz / (4 * (416 + 1)) = 9592 baud
+    BAUDCONbits.BRG16 = 1;
+    TXSTAbits.BRGH = 1;
+    TXSTAbits.SYNC = 0;
+    RCSTAbits.SPEN = 1;
+    TXSTAbits.TXEN = 1; // TXREG is empty, TXIF goes up
+    PIE1bits.TXIE = 1;
+}
+
+// from the interrupt handler, TXREG is free
+void stats_dump_byte() {
+    byte b;
+    if (dump.pos < 4) {
+        const byte header[4] = { 0xA5, 0x5A, stats_version, stat_words };
+        b = header[dump.pos];
+    } else if (dump.pos < dump_length - 1) {
+        byte i = dump.pos - 4;
+        b = dump.words[i >> 2] >> (8 * (i & 3));
+        dump.sum += b;
+    } else {
+        b = -dump.sum;
+        PIE1bits.TXIE = 0; // the last one
+    }
+    TXREG = b;
+    dump.pos++;
+}
+
+// once the last byte is out of the shift register
+void stats_dump_end() {
+    if (TXSTAbits.TRMT && dump.pos == dump_length) {
+        TXSTAbits.TXEN = 0;
+        RCSTAbits.SPEN = 0;
+        dump.pos = 0;
+    }
+}
+#endif
+
+#if mode == 1
+/* <LISTEN GOVERNOR> */
+
+// The switch wakes every listen_normal_ms. A command switches it to
+// listen_fast_ms for listen_fast_hold_s so follow-up presses are quick,
+// and a link that has been quiet for listen_idle_after_s backs off to
+// listen_idle_ms. wakeups/hits tell how well the schedule fits. A low
+// battery puts a floor under all three.
+#define fast_wakeups (listen_fast_hold_s * 1000UL / listen_fast_ms)
+#define idle_wakeups (listen_idle_after_s * 1000UL / listen_normal_ms)
+#if fast_wakeups > 65535
+#error // fast_left is 16 bits wide
+#endif
+
+struct {
+    unsigned int period; // current period in Timer1 ticks
+    unsigned int shortest; // period floor set by <BATTERY>, 0 for none
+    unsigned int fast_left; // fast wake-ups left after the last hit
+    unsigned long quiet; // normal wake-ups since the fast period ran out
+    unsigned long wakeups; // all RX windows opened on schedule
+    unsigned long hits; // wake-ups that ended in a command
+    unsigned long woke_at; // Timer1 clock at the last wake-up
+} governor = { timer1_ticks(listen_normal_ms), 0, 0, 0, 0, 0, 0 };
+
+void governor_set(unsigned int period) {
+    governor.period = period < governor.shortest ? governor.shortest : period;
+}
+
+void governor_wake() {
+    governor.wakeups++;
+    governor.woke_at = timer1_now();
+    if (governor.fast_left) {
+        governor.fast_left--;
+        if (governor.fast_left == 0) {
+            governor_set(timer1_ticks(listen_normal_ms));
+        }
+    } else if (governor.quiet < idle_wakeups) {
+        governor.quiet++;
+        if (governor.quiet == idle_wakeups) {
+            governor_set(timer1_ticks(listen_idle_ms));
+        }
+    }
+}
+
+void governor_hit() {
+    governor.hits++;
+    governor.quiet = 0;
+    governor.fast_left = fast_wakeups;
+    governor_set(timer1_ticks(listen_fast_ms));
+    // start the short period right away, counted from the wake-up that
+    // heard the command, which is what a remote keeping in sync expects
+    unsigned long since = timer1_now() - governor.woke_at;
+    timer_start(TIMER_LISTEN, since < governor.period ? governor.period - since : 1);
+}
+
+#if relay_latch == 1
+/* <HIGH-ENDURANCE FLASH> */
+
+// The last 128 words of program memory (4 rows of 32) are good for 100k
+// erase/write cycles per row, only their low bytes are high-endurance.
+// The project keeps code out of them (ROM ranges default,-1F80-1FFF).
+#define hef_start 0x1F80
+#define hef_words 128
+#define hef_row 32
+#define hef_erased 0x3FFF
+
+unsigned int flash_read(unsigned int address) {
+    PMCON1bits.CFGS = 0;
+    PMADRH = address >> 8;
+    PMADRL = address & 0xFF;
+    PMCON1bits.RD = 1;
+    NOP();
+    NOP();
+    return (unsigned int)PMDATH << 8 | PMDATL;
+}
+
+// the unlock sequence, the CPU stalls ~2 ms for the erase/write
+void flash_unlock() {
+    byte gie = INTCONbits.GIE; // callers may have interrupts masked
+    INTCONbits.GIE = 0;
+    PMCON2 = 0x55;
+    PMCON2 = 0xAA;
+    PMCON1bits.WR = 1;
+    NOP();
+    NOP();
+    INTCONbits.GIE = gie;
+}
+
+void flash_erase_row(unsigned int address) {
+    PMADRH = address >> 8;
+    PMADRL = address & 0xFF;
+    PMCON1bits.CFGS = 0;
+    PMCON1bits.FREE = 1;
+    PMCON1bits.WREN = 1;
+    flash_unlock();
+    PMCON1bits.WREN = 0;
+}
+
+// the write latches are back to 0x3FFF after every write, so loading
+// just one word and writing leaves the rest of the row as it was
+void flash_write_word(unsigned int address, unsigned int data) {
+    PMADRH = address >> 8;
+    PMADRL = address & 0xFF;
+    PMCON1bits.CFGS = 0;
+    PMCON1bits.FREE = 0;
+    PMCON1bits.LWLO = 0; // write the latches right away
+    PMCON1bits.WREN = 1;
+    PMDATH = data >> 8;
+    PMDATL = data & 0xFF;
+    flash_unlock();
+    PMCON1bits.WREN = 0;
+}
+
+/* <LATCH STATE> */
+
+// The relay stays on the side it was last pulsed to, so a command for
+// that side is skipped (no pulse, no recharge) and counted in
+// latch.skipped. Every pulse appends the new side to a log that runs
+// around the HEF rows: entering a row erases the one after it, so the
+// newest entry is the one right before the only erased gap and every
+// row is erased once per 128 pulses. The agreed data rate goes in the
+// same log as hef_rate | rate, and again at the head of every row so it
+// never runs off the end (see <DATA RATE>).
+#define hef_rate 0x80 // the sides are 7-bit characters
+struct {
+    char side; // CHAR_ON/CHAR_OFF, 0 until the first pulse ever
+    byte next; // log entry to write next
+    unsigned long skipped; // commands the relay was already set for
+    #if rate_select == 1
+        byte rate; // the newest rate entry, 0 for none
+    #endif
+} latch = { 0, 0, 0 };
+
+void latch_load() {
+    for (byte i = 0; i < hef_words; i++) {
+        byte next = (i + 1) % hef_words;
+        if (flash_read(hef_start + i) != hef_erased && flash_read(hef_start + next) == hef_erased) {
+            latch.next = next;
+            break;
+        }
+    }
+    // newest entry first, back to the gap
+    for (byte n = 1; n < hef_words; n++) {
+        unsigned int entry = flash_read(hef_start + (latch.next + hef_words - n) % hef_words);
+        if (entry == hef_erased) {
+            break;
+        }
+        if (!latch.side && (entry == CHAR_ON || entry == CHAR_OFF)) {
+            latch.side = entry;
+        }
+        #if rate_select == 1
+            if (!latch.rate && (entry & ~0x03) == hef_rate) {
+                latch.rate = entry;
+            }
+        #endif
+    }
+}
+
+void latch_append(byte entry) {
+    if (latch.next % hef_row == 0) {
+        flash_erase_row(hef_start + (latch.next + hef_row) % hef_words);
+    }
+    flash_write_word(hef_start + latch.next, entry);
+    latch.next = (latch.next + 1) % hef_words;
+}
+
+void latch_store(char side) {
+    latch.side = side;
+    #if rate_select == 1
+        if (latch.next % hef_row == 0 && latch.rate) {
+            latch_append(latch.rate);
+        }
+    #endif
+    latch_append(side);
+}
+
+#if rate_select == 1
+void latch_store_rate(byte r) {
+    latch.rate = hef_rate | r;
+    latch_append(latch.rate);
+}
+#endif
+#else
+#define latch_load()
+#define latch_store(side)
+#define latch_store_rate(r)
+#endif
+
+/* <RELAY SEQUENCE> */
+
+// A relay command runs (precharge ->) pulse -> recharge -> idle, one
+// step each time TIMER_RELAY expires, so the switch keeps listening and
+// sleeping meanwhile. The charges poll the capacitor every cap_poll_ms
+// and end once it is full; a precharge that runs out of time drops the
+// command rather than pulse a coil it can't move. A command that comes
+// in mid-sequence runs after it, unless it repeats the one running.
+#define RELAY_IDLE 0
+#define RELAY_PRECHARGE 1
+#define RELAY_PULSE 2
+#define RELAY_RECHARGE 3
+byte relay_phase = RELAY_IDLE;
+char relay_command = 0; // CHAR_ON/CHAR_OFF being carried out
+char relay_next = 0; // CHAR_ON/CHAR_OFF waiting for the relay, or 0
+unsigned int relay_pulse_ticks = timer1_ticks(pulse_ms); // see <BATTERY>
+
+void relay_pulse() {
+    relay_reset();
+    nCAPEN = !1;
+    if (relay_command == CHAR_ON) {
+        HBR1 = 1;
+    } else {
+        HBRN = 1;
+    }
+    relay_phase = RELAY_PULSE;
+    stats_start(STAT_PULSE);
+    timer_start(TIMER_RELAY, relay_pulse_ticks);
+}
+
+// charge the voltage doubling capacitor, relay_step() checks on it
+void relay_charge(byte phase) {
+    cap_charge();
+    stats_start(STAT_CHARGE);
+    cap.polls = 0;
+    relay_phase = phase;
+    timer_start(TIMER_RELAY, timer1_ticks(cap_poll_ms));
+}
+
+void relay_start(char command) {
+    if (relay_phase != RELAY_IDLE) {
+        relay_next = command != relay_command ? command : 0;
+        return;
+    }
+    #if relay_latch == 1
+        if (command == latch.side) {
+            latch.skipped++;
+            return;
+        }
+    #endif
+    relay_command = command;
+    if (cap_charged()) {
+        relay_pulse();
+    } else {
+        relay_charge(RELAY_PRECHARGE); // it has leaked since the last one
+    }
+}
+
+void relay_step() {
+    if (relay_phase == RELAY_PULSE) {
+        HBR1 = 0;
+        HBRN = 0;
+        stats_stop(STAT_PULSE);
+        stats_add(pulses, 1);
+        latch_store(relay_command);
+        relay_charge(RELAY_RECHARGE);
+        return;
+    }
+    // RELAY_PRECHARGE or RELAY_RECHARGE
+    cap.polls++;
+    byte full = cap_charged();
+    if (!full && cap.polls < cap.timeout_polls) {
+        timer_start(TIMER_RELAY, timer1_ticks(cap_poll_ms));
+        return;
+    }
+    relay_reset();
+    stats_stop(STAT_CHARGE);
+    if (!full) {
+        cap.timeouts++;
+    } else if (relay_phase == RELAY_PRECHARGE) {
+        relay_pulse();
+        return;
+    }
+    relay_phase = RELAY_IDLE;
+    if (relay_next) {
+        char command = relay_next;
+        relay_next = 0;
+        relay_start(command);
+    }
+}
+
+/* <DUPLICATES> */
+
+// The remote keeps sending a press for its whole burst, so the fast
+// wake-ups after a command hear it again. Each press carries its own
+// sequence number and the switch remembers the pipe and sequence number
+// of the last dedup_cache_size commands; a frame that matches one of
+// them is dropped before the relay. The cache is cleared once nothing
+// has been heard for dedup_hold_ms, so a remote that restarts its count
+// is only ignored if it is pressed again within that time.
+struct {
+    byte pipe[dedup_cache_size];
+    byte sequence[dedup_cache_size];
+    byte used; // entries in use
+    byte next; // entry to overwrite next
+    unsigned long duplicates; // frames dropped as repeats
+} dedup = { {0}, {0}, 0, 0, 0 };
+
+// returns 1 for a press that was already acted on, remembers it otherwise
+byte dedup_seen(byte pipe, byte sequence) {
+    timer_start(TIMER_DEDUP, timer1_ticks(dedup_hold_ms));
+    for (byte i = 0; i < dedup.used; i++) {
+        if (dedup.pipe[i] == pipe && dedup.sequence[i] == sequence) {
+            dedup.duplicates++;
+            return 1;
+        }
+    }
+    dedup.pipe[dedup.next] = pipe;
+    dedup.sequence[dedup.next] = sequence;
+    dedup.next = (dedup.next + 1) % dedup_cache_size;
+    if (dedup.used < dedup_cache_size) {
+        dedup.used++;
+    }
+    return 0;
+}
+
+void dedup_clear() {
+    dedup.used = 0;
+    dedup.next = 0;
+}
+
+/* <BATTERY> */
+
+// VDD is the ADC's reference, so it is measured backwards: the ADC
+// converts the 1.024 V FVR and VDD = 1.024 V * 1024 / reading. The FVR
+// and the ADC are only on for that one conversion.
+//
+// Each level down the switch listens less often, charges the capacitor
+// closer to VDD and for longer, and drives the coil longer, as battery
+// plus capacitor come down towards the relay's must-operate voltage.
+// ACKs go out quieter, and the LED (2 mA for as long as the relay is
+// on) blinks after each command instead of following the relay.
+#define BATTERY_OK 0
+#define BATTERY_LOW 1
+#define BATTERY_EMPTY 2
+#define fvr_channel 0b11111
+#define fvr_mv 1024
+#if 3 * cap_timeout_polls > 255
+#error // cap.timeout_polls is 8 bits wide
+#endif
+
+typedef struct {
+    unsigned int below_mv; // the level starts below this VDD
+    unsigned int listen_floor; // shortest listen period in Timer1 ticks
+    byte cap_target; // cap_charged() reading
+    byte charge_polls; // charge timeout in cap_poll_ms checks
+    unsigned int pulse_ticks; // relay coil drive in Timer1 ticks
+    byte rf_power; // RF_SETUP output power bits
+    byte blinks; // LED blinks after a command, 0 to follow the relay
+} battery_profile;
+
+const battery_profile battery_profiles[] = {
+    { 0xFFFF, 0, cap_target_reading, cap_timeout_polls,
+      timer1_ticks(pulse_ms), 0x06, 0 }, // 0 dBm
+    { battery_low_mv, timer1_ticks(listen_normal_ms), cap_full_reading * 98 / 100,
+      2 * cap_timeout_polls, timer1_ticks(pulse_ms * 3 / 2), 0x04, 2 }, // -6 dBm
+    { battery_empty_mv, timer1_ticks(listen_idle_ms), cap_full_reading * 98 / 100,
+      3 * cap_timeout_polls, timer1_ticks(2 * pulse_ms), 0x02, 4 }, // -12 dBm
+};
+
+struct {
+    unsigned int mv; // last reading
+    byte level; // BATTERY_OK, BATTERY_LOW or BATTERY_EMPTY
+    unsigned int wakeups; // listen wake-ups since the last reading
+    byte blinks; // LED changes left in the running blink
+} battery = { 0, BATTERY_OK, 0, 0 };
+
+unsigned int battery_read_mv() {
+    FVRCON = 0b10000001; // FVR on, 1.024 V to the ADC
+    while (!FVRCONbits.FVRRDY) {}
+    ADCON0 = fvr_channel << 2 | 0x01; // select the FVR, ADC on
+    __delay_us(5); // acquisition
+    ADCON0bits.GO_nDONE = 1;
+    while (ADCON0bits.GO_nDONE) {}
+    ADCON0 = 0; // ADC off
+    FVRCON = 0; // FVR off
+    unsigned int reading = (unsigned int)ADRESH << 2 | ADRESL >> 6; // 10 bits
+    return reading ? (unsigned int)((unsigned long)fvr_mv * 1024 / reading) : 0xFFFF;
+}
+
+void battery_apply() {
+    const battery_profile *p = &battery_profiles[battery.level];
+    governor.shortest = p->listen_floor;
+    governor_set(governor.period);
+    cap.target = p->cap_target;
+    cap.timeout_polls = p->charge_polls;
+    relay_pulse_ticks = p->pulse_ticks;
+    nrf_write(0x06, (nrf_read(0x06) & ~0x06) | p->rf_power); // RF_SETUP
+    if (p->blinks && !battery.blinks) {
+        LATLED = 0;
+        stats_stop(STAT_LED);
+    }
+}
+
+void battery_check() {
+    battery.wakeups = 0;
+    battery.mv = battery_read_mv();
+    byte level = battery.level;
+    while (level < BATTERY_EMPTY && battery.mv < battery_profiles[level + 1].below_mv) {
+        level++;
+    }
+    while (level > BATTERY_OK
+            && battery.mv >= battery_profiles[level].below_mv + battery_hysteresis_mv) {
+        level--;
+    }
+    if (level != battery.level) {
+        battery.level = level;
+        battery_apply();
+    }
+}
+
+// called every listen wake-up; the relay stage pulls VDD down while it
+// works, so a reading that falls due then waits for it to finish
+void battery_wake() {
+    if (battery.wakeups < battery_check_wakeups) {
+        battery.wakeups++;
+    }
+    if (battery.wakeups >= battery_check_wakeups && relay_phase == RELAY_IDLE) {
+        battery_check();
+    }
+}
+
+// one LED change of the low-battery blink, on for the odd counts
+void led_step() {
+    battery.blinks--;
+    LATLED = battery.blinks & 1;
+    if (LATLED) {
+        stats_start(STAT_LED);
+    } else {
+        stats_stop(STAT_LED);
+    }
+    if (battery.blinks) {
+        timer_start(TIMER_LED, timer1_ticks(battery_blink_ms));
+    }
+}
+
+void led_show(char command) {
+    byte blinks = battery_profiles[battery.level].blinks;
+    if (blinks) {
+        battery.blinks = 2 * blinks;
+        led_step();
+    } else if (command == CHAR_ON) {
+        LATLED = 1;
+        stats_start(STAT_LED);
+    } else {
+        LATLED = 0;
+        stats_stop(STAT_LED);
+    }
+}
+
+#if rate_select == 1
+/* <DATA RATE> */
+
+// A command that comes in with the RPD set was over -64 dBm, 18 dB more
+// than 2 Mbps needs. After rate_confirm of those in a row the ACKs offer
+// the next rate up; one without it while above rate_home offers the
+// next one down, and one that only got in on home, where remotes fall
+// back at rate_home, drops straight back there. Like a channel move the
+// link changes once a command has been ACKed with the new rate.
+#define rate_confirm 4 // strong commands in a row before stepping up
+
+struct {
+    byte current; // rate the link is on...
+    byte next; // ...and the one the ACKs announce
+    byte tuned; // RF_SETUP holds this one
+    byte strong; // commands in a row that set the RPD
+} rate = { rate_home, rate_home, rate_home, 0 };
+
+void rate_tune(byte r) {
+    if (rate.tuned != r) {
+        nrf_write(0x06, (nrf_read(0x06) & ~0x28) | rate_bits(r)); // RF_SETUP
+        rate.tuned = r;
+    }
+}
+
+// the rate the HEF log kept over a reset
+void rate_load() {
+    #if relay_latch == 1
+        if (latch.rate) {
+            rate.current = rate.next = latch.rate & 0x03;
+        }
+    #endif
+    rate_tune(rate.current);
+}
+
+// a command came in, strong if it set the RPD, home if in a home window
+void rate_heard(byte strong, byte home) {
+    byte was = rate.current;
+    rate.current = rate.next; // what the ACKs have said
+    if (home) {
+        // the remote lost us at the agreed rate, this ACK said rate_home
+        rate.current = rate.next = rate_home;
+        rate.strong = 0;
+    } else if (!strong) {
+        rate.strong = 0;
+        if (rate.current > rate_home) {
+            rate.next = rate.current - 1;
+        }
+    } else if (++rate.strong >= rate_confirm) {
+        rate.strong = 0;
+        if (rate.current < 2) {
+            rate.next = rate.current + 1;
+        }
+    }
+    if (rate.current != was) {
+        latch_store_rate(rate.current);
+    }
+}
+#endif
+
+#if channel_select > 0
+/* <CHANNELS> */
+
+// Every empty window samples the RPD (a carrier over -64 dBm for 40 us)
+// of its own channel before it closes, and every survey_every-th one
+// then retunes the nRF, still in RX, to sample one of the others. Once
+// all of them have survey_samples, the quietest, if clearly quieter
+// than the current one, goes into the ACKs and the link moves there at
+// the wake-up after the next command. The counts are halved after each
+// pick so old noise fades. Away from home, every home_every-th empty
+// window is followed by one on home for a remote that lost track.
+// Hopping needs none of that: each wake-up takes the next channel in
+// hop_sequence, which comes back to home by itself, and the RPD counts
+// are only kept for the stats.
+#define survey_every 16 // empty windows per sample of another channel
+#define survey_samples 32 // of each channel before a pick
+#define channel_margin 26 // how much less busy the pick must be, in 1/256
+
+struct {
+    byte current; // channel_table index the link is on...
+    byte next; // ...and the one the ACKs announce
+    byte tuned; // RF_CH holds channel_table[tuned]
+    byte survey; // channel the next sample goes to
+    byte empty; // empty windows since the last sample
+    byte home_left; // empty windows until the next one on home
+    byte home_open; // the window open now is the one on home
+    byte hop; // wake-ups so far, the place in hop_sequence
+    unsigned int samples[channel_count]; // RPD samples since the last pick
+    unsigned int busy[channel_count]; // ...that found a carrier
+} channel = { 0, 0, 0, 1, 0, home_every, 0 };
+
+void channel_tune(byte i) {
+    if (channel.tuned != i) {
+        nrf_write(0x05, channel_table[i]); // RF_CH
+        channel.tuned = i;
+    }
+}
+
+// count the RPD of the channel the nRF is receiving on
+void channel_sample() {
+    byte i = channel.tuned;
+    byte busy = nrf_read(0x09) & 0x01; // RPD
+    channel.samples[i]++;
+    channel.busy[i] += busy;
+    stats_add(rpd_samples[i], 1);
+    stats_add(rpd_busy[i], busy);
+}
+
+#if channel_select == 1
+void channel_pick() {
+    byte best = channel.current;
+    unsigned int share[channel_count]; // busy samples in 1/256
+    for (byte i = 0; i < channel_count; i++) {
+        if (channel.samples[i] < survey_samples) {
+            return;
+        }
+        share[i] = (unsigned long)channel.busy[i] * 256 / channel.samples[i];
+    }
+    for (byte i = 0; i < channel_count; i++) {
+        if (share[i] < share[best]) {
+            best = i;
+        }
+    }
+    if (share[best] + channel_margin < share[channel.current]) {
+        channel.next = best;
+    }
+    for (byte i = 0; i < channel_count; i++) {
+        channel.samples[i] >>= 1;
+        channel.busy[i] >>= 1;
+    }
+}
 
-    SSPCON1bits.SSPEN = 1; // enable SPI
+// an empty window closed, the nRF is still powered; 1 if another
+// window should open, on home
+byte channel_closed() {
+    if (channel.home_open) {
+        channel.home_open = 0;
+        channel_tune(channel.current);
+        #if rate_select == 1
+            rate_tune(rate.current);
+        #endif
+        return 0;
+    }
+    byte away = channel.current != 0;
+    #if rate_select == 1
+        away |= rate.current != rate_home;
+    #endif
+    if (away && --channel.home_left == 0) {
+        channel.home_left = home_every;
+        channel.home_open = 1;
+        channel_tune(0);
+        #if rate_select == 1
+            rate_tune(rate_home);
+        #endif
+        return 1;
+    }
+    if (++channel.empty < survey_every) {
+        return 0;
+    }
+    channel.empty = 0;
+    if (channel.survey == channel.current) {
+        channel.survey = (channel.survey + 1) % channel_count;
+    }
+    channel_tune(channel.survey);
+    LATCE = 1;
+    clock_wait_us(200); // RX settling and the 40 us the RPD needs
+    channel_sample();
+    LATCE = 0;
+    channel_tune(channel.current);
+    channel.survey = (channel.survey + 1) % channel_count;
+    channel_pick();
+    return 0;
 }
+#endif
 
-void nrf_setup() {
-    LATCE = 0; // enables receiving in RX mode and transmitting in TX mode
-    __delay_ms(1);
-    LATCSN = 1; // CSN is active-low, so set it high
-    __delay_ms(2); // breathing time
+// a command came in, its ACK has announced channel.next
+void channel_heard() {
+    stats_add(channel_commands[channel.tuned], 1);
+    channel.home_open = 0;
+    channel.current = channel.next; // nrf_listen() tunes there
+}
+#endif
 
-    // set CONFIG.
-    LATCSN = 0;
-    writeSPIByte(0x20);
-    #if mode == 0
-        writeSPIByte(0b00000010); // TX -> PWR_UP, PTX
-    #endif
-    #if mode == 1
-        writeSPIByte(0b00000011); // RX -> PWR_UP, PRX
-    #endif
-    LATCSN = 1;
-    // you need 50 nanoseconds between transmissions
-    // but an instruction takes longer to execute than that.
+#if carrier_detect == 1
+/* <CARRIER DETECT> */
 
-    // disable auto-ack
-    LATCSN = 0;
-    writeSPIByte(0x21);
-    writeSPIByte(0x00);
-    LATCSN = 1;
+// A window first stays open for carrier_ticks: RX settling, the longest
+// the remote leaves the air between two packets and the 40 us the RPD
+// needs, LFINTOSC's 15% on top. The RPD only shows the carrier right
+// now, and a packet is on air for a third of a blind burst at most, so
+// carrier_listen() reads it over and over meanwhile. A carrier keeps
+// the window open a full rate_window_ms from there, which is what the
+// remote's packet spacing needs to get a whole one in; none closes it
+// as empty. A remote under -64 dBm leaves no carrier, it only gets
+// through when a whole packet falls in the short window. After a
+// command like that the windows open full length again until
+// carrier_confirm commands in a row set the RPD.
+#if ack_mode == 1
+// ARD between retransmissions, a MAX_RT restarts in TX settling
+#define carrier_gap_us(r) (((rate_retr(r) >> 4) + 1) * 250UL)
+#else
+// a Timer1 tick in standby and TX settling between chunks, see
+// nrf_burst(), or less without tx_reuse
+#define carrier_gap_us(r) (1000000UL / timer1_ticks_per_s + 130)
+#endif
+#define carrier_ticks(r) ((unsigned int)(((130 + carrier_gap_us(r) + 40) * 115 / 100 * timer1_ticks_per_s + 999999) / 1000000))
 
-    // set CONFIG again so that CRC is disabled
-    // (auto-ack forces CRC to be enabled)
-    LATCSN = 0;
-    writeSPIByte(0x20);
-    #if mode == 0
-        writeSPIByte(0b00000010); // TX -> PWR_UP, PTX
-    #endif
-    #if mode == 1
-        writeSPIByte(0b00000011); // RX -> PWR_UP, PRX
-    #endif
-    LATCSN = 1;
+struct {
+    byte weak; // a command came in without the RPD...
+    byte strong; // ...and this many in a row with it since
+} carrier = { 0, 0 };
 
-    // set frequency channel to 2
-    LATCSN = 0;
-    writeSPIByte(0x25);
-    writeSPIByte(0x02);
-    LATCSN = 1;
+// the nRF is in RX for the window rate r takes; 1 if it should stay open
+byte carrier_listen(byte r) {
+    if (carrier.weak) {
+        return 1;
+    }
+    stats_add(carrier_checks, 1);
+    timer_start(TIMER_WINDOW, carrier_ticks(r));
+    byte seen = 0;
+    while (!seen && !events.irq && !(timer_fired & (1 << TIMER_WINDOW))) {
+        if (events.timer1) {
+            timers_run();
+        }
+        seen = nrf_read(0x09) & 0x01; // RPD
+    }
+    timer_fired &= ~(1 << TIMER_WINDOW);
+    if (!seen && !events.irq) {
+        return 0;
+    }
+    stats_add(carrier_hits, 1);
+    return 1;
+}
 
-    // disable auto retransmit
-    LATCSN = 0;
-    writeSPIByte(0x24);
-    writeSPIByte(0x00);
-    LATCSN = 1;
+// a command came in, strong if it set the RPD
+void carrier_heard(byte strong) {
+    if (!strong) {
+        carrier.weak = 1;
+        carrier.strong = 0;
+    } else if (carrier.weak && ++carrier.strong >= carrier_confirm) {
+        carrier.weak = 0;
+    }
+}
+#endif
 
-    // address width = 5
-    LATCSN = 0;
-    writeSPIByte(0x23);
-    writeSPIByte(0x03);
-    LATCSN = 1;
+/* <VOTING> */
 
-    // data rate = 1MB, signal strength 0dBm
-    LATCSN = 0;
-    writeSPIByte(0x26);
-    writeSPIByte(0x06);
-    LATCSN = 1;
+// nrf_postreceive() takes every payload the RX FIFO holds into rx_ring,
+// which keeps the last rx_ring_size of them until a command is decided
+// or a window closes empty. Each one is decoded on its own and the
+// command most of them agree on (same pipe and sequence number) wins
+// once vote_quorum do. Without the CRC a damaged packet can still decode,
+// so a blind switch waits for two; in ack mode the remote stops at the
+// first ACK and one has to do. When none decodes on its own but the
+// ring holds three of the same width from one pipe, each bit is taken
+// from the two or three that agree and the result is decoded instead;
+// only with the CRC to tell three damaged packets of one press from
+// three frames of noise.
+#define rx_ring_size 3 // as deep as the nRF's RX FIFO
+#define vote_quorum (crc == 0 && ack_mode == 0 ? 2 : 1)
 
-    // 1 byte payload for pipe 0
-    LATCSN = 0;
-    writeSPIByte(0x31);
-    writeSPIByte(0x01);
-    LATCSN = 1;
+struct {
+    byte payload[rx_ring_size][receive_length];
+    byte width[rx_ring_size];
+    byte pipe[rx_ring_size];
+    char command[rx_ring_size]; // 0 if it didn't decode
+    byte sequence[rx_ring_size];
+    byte next; // slot the next payload goes in
+    byte used; // slots in use
+} rx_ring;
 
-    // set address for pipe 0
-    const char *addr = "test1";
-    LATCSN = 0;
-    // different addresses for TX and RX
-    #if mode == 0
-        writeSPIByte(0x30);
-    #endif
-    #if mode == 1
-        writeSPIByte(0x2A);
+// what a payload of width bytes asks of this switch, 0 if it doesn't
+// decode
+char payload_decode(const byte *payload, byte width, byte *sequence) {
+    #if command_frames == 1
+        return frame_decode(payload, width, sequence);
+    #elif fec == 1
+        byte message[fec_message_length];
+        if (fec_decode(payload, fec_message_length, message)
+                && crc_valid(message, message_length)) {
+            *sequence = message[1];
+            return message[0];
+        }
+        return 0;
+    #else
+        *sequence = payload[command_copies];
+        if (!crc_valid(payload, command_copies + 1)) {
+            return 0;
+        }
+        byte on_count = 0;
+        byte off_count = 0;
+        for (byte i=0; i<command_copies; i++) {
+            if (payload[i] == CHAR_ON) {
+                on_count++;
+            } else if (payload[i] == CHAR_OFF) {
+                off_count++;
+            }
+        }
+        if (on_count >= correctness_threshold) {
+            return CHAR_ON;
+        } else if (off_count >= correctness_threshold) {
+            return CHAR_OFF;
+        }
+        return 0;
     #endif
-    for (byte j = 0; j < 5; j++) {
-        writeSPIByte(addr[j]);
+}
+
+// decode the payload just read into rx_ring.payload[rx_ring.next]
+void rx_ring_push(byte pipe, byte width) {
+    byte i = rx_ring.next;
+    rx_ring.pipe[i] = pipe;
+    rx_ring.width[i] = width;
+    rx_ring.command[i] = payload_decode(rx_ring.payload[i], width, &rx_ring.sequence[i]);
+    rx_ring.next = (i + 1) % rx_ring_size;
+    if (rx_ring.used < rx_ring_size) {
+        rx_ring.used++;
     }
-    LATCSN = 1;
 }
 
-// configure interrupts (both internal and external)
-void int_setup() {
-    TRISBbits.TRISB0 = 1; // set INT pin to read (bruh)
-    ANSELBbits.ANSB0 = 0; // digital read
+void rx_ring_clear() {
+    rx_ring.used = 0;
+    rx_ring.next = 0; // slots 0 to used-1 hold payloads
+}
 
-    INTCONbits.GIE = 1; // global interrupt enable
-    INTCONbits.PEIE = 1; // enable interrupt from peripherals
-    //INTCONbits.INTE = 1; // interrupt enable
-    //OPTION_REGbits.INTEDG = 0; // falling edge detect
-    INTCONbits.IOCIE = 1; // interrupt on change enable
-    IOCBNbits.IOCBN0 = 1; // falling edge detect
+// the command rx_ring has a quorum for and its pipe and sequence number,
+// 0 if there is none yet
+char rx_ring_vote(byte *pipe, byte *sequence) {
+    char command = 0;
+    byte votes = 0;
+    for (byte i = 0; i < rx_ring.used; i++) {
+        if (!rx_ring.command[i]) {
+            continue;
+        }
+        byte agree = 0;
+        for (byte j = 0; j < rx_ring.used; j++) {
+            if (rx_ring.command[j] == rx_ring.command[i] && rx_ring.pipe[j] == rx_ring.pipe[i]
+                    && rx_ring.sequence[j] == rx_ring.sequence[i]) {
+                agree++;
+            }
+        }
+        if (agree > votes) {
+            votes = agree;
+            command = rx_ring.command[i];
+            *pipe = rx_ring.pipe[i];
+            *sequence = rx_ring.sequence[i];
+        }
+    }
+    #if crc == 1
+        if (votes == 0 && rx_ring.used == rx_ring_size) {
+            for (byte i = 1; i < rx_ring_size; i++) {
+                if (rx_ring.width[i] != rx_ring.width[0] || rx_ring.pipe[i] != rx_ring.pipe[0]) {
+                    return 0;
+                }
+            }
+            byte merged[receive_length];
+            for (byte k = 0; k < rx_ring.width[0]; k++) {
+                byte a = rx_ring.payload[0][k];
+                byte b = rx_ring.payload[1][k];
+                byte c = rx_ring.payload[2][k];
+                merged[k] = (a & b) | (a & c) | (b & c);
+            }
+            command = payload_decode(merged, rx_ring.width[0], sequence);
+            *pipe = rx_ring.pipe[0];
+            votes = 2; // every bit has two packets behind it
+        }
+    #endif
+    return votes >= vote_quorum ? command : 0;
 }
+#endif
 
-void timer1_reset() {
-    TMR1H = 240; // preset for timer1 MSB register
-    TMR1L = 221; // preset for timer1 LSB register
+#if mode == 0
+#if command_frames == 0
+// build the payload for a command once per press (frame_encode() with
+// command_frames)
+void payload_encode(const char command, byte sequence, byte *payload) {
+    #if fec == 1
+        byte message[fec_message_length] = { command, sequence };
+        #if crc == 1
+            crc_append(message, message_length);
+        #endif
+        fec_encode(message, fec_message_length, payload);
+    #else
+        for (byte j = 0; j < command_copies; j++) {
+            payload[j] = command;
+        }
+        payload[command_copies] = sequence;
+        #if crc == 1
+            crc_append(payload, command_copies + 1);
+        #endif
+    #endif
 }
+#endif
 
-// Timer0 is disabled during sleep so we use Timer1
-#if mode == 1
-void timer1_setup() {
-    //Timer1 Registers Prescaler= 1 - TMR1 Preset = 61661 - Freq = 2.00 Hz - Period = 0.500000 seconds
-    T1CONbits.T1CKPS1 = 0;   // bits 5-4  Prescaler Rate Select bits
-    T1CONbits.T1CKPS0 = 0;   // bit 4
-    T1CONbits.T1OSCEN = 1;   // bit 3 Timer1 Oscillator Enable Control bit 1 = on
-    T1CONbits.nT1SYNC = 1;   // bit 2 Timer1 External Clock Input Synchronization Control bit...1 = Do not synchronize external clock input
-    T1CONbits.TMR1CS = 0b11; // bit 1 Timer1 Clock Source Select bit...0b11 = LFINTOSC
+// an IRQ never came, the rest of the press is given up
+byte nrf_gone = 0;
 
-    TMR1H = 0; // clear offset registers before enabling interrupts
-    TMR1L = 0;
-    PIR1bits.TMR1IF = 0;
-    PIE1bits.TMR1IE = 1; // enable Timer1 interrupts on overflow
-    timer1_reset();      // (re)set offset registers
-    T1CONbits.TMR1ON = 1; // bit 0 enables timer
-}
+#if tx_reuse == 1
+byte tx_loaded = 0; // the payload is still in the TX FIFO
 #endif
 
-#if mode == 0
-void nrf_transmit(const char payload) {
-    // load a payload
-    LATCSN = 0;
-    writeSPIByte(0xA0); // W_TX_PAYLOAD
-    for (int j = receive_length-1; j >= 0; j--) {
-        writeSPIByte(payload);
+// sleep until the nRF pulls IRQ low, the buttons wait; 0 if it hasn't
+// within nrf_irq_timeout_ms (a dead module, a brown-out, or an edge
+// lost to an interrupt that was never cleared)
+byte nrf_wait_irq() {
+    timer_start(TIMER_BURST, timer1_ticks(nrf_irq_timeout_ms));
+    while (!events.irq && !(timer_fired & (1 << TIMER_BURST))) {
+        INTCONbits.GIE = 0;
+        if (!events.irq && !events.timer1 && !spi_active) {
+            SLEEP();
+        }
+        INTCONbits.GIE = 1;
+        if (events.timer1) {
+            timers_run();
+        }
     }
-    LATCSN = 1;
+    timer_stop(TIMER_BURST);
+    timer_fired &= ~(1 << TIMER_BURST);
+    if (!events.irq) {
+        LATCE = 0;
+        nrf_gone = 1;
+        return 0;
+    }
+    events.irq = 0;
+    return 1;
+}
+
+void nrf_transmit(const byte *payload, byte width) {
+    #if tx_reuse == 1
+        // a MAX_RT leaves it there for the next CE pulse
+        if (!tx_loaded) {
+            nrf_command(0xA0, payload, 0, width); // W_TX_PAYLOAD
+            tx_loaded = 1;
+        }
+    #else
+        // load a payload
+        nrf_command(0xA0, payload, 0, width); // W_TX_PAYLOAD
+    #endif
+    events.irq = 0;
 
     // pulse CE to start transmission
     LATCE = 1;
-    __delay_us(20);
+    clock_wait_us(20);
     LATCE = 0;
     // __delay_us(100); // delay between transmissions
 }
+
+// the nRF is powered down between presses (0.9 uA instead of 22 uA in
+// standby) and takes Tpd2stby to start its oscillator again
+void nrf_power_up() {
+    nrf_gone = 0;
+    nrf_write(0x00, nrf_config | 0x02); // CONFIG: PWR_UP
+    clock_wait_us(1500);
+}
+
+void nrf_power_down() {
+    #if tx_reuse == 1
+        // what is left in the TX FIFO has been sent or given up on, and
+        // flushing it ends REUSE_TX_PL
+        nrf_command(0xE1, 0, 0, 0); // FLUSH_TX
+        tx_loaded = 0;
+    #else
+        // the last payloads of a blind burst are still in the TX FIFO
+        for (byte i = 0; i < 20 && !(nrf_read(0x17) & 0x10); i++) { // FIFO_STATUS: TX_EMPTY
+            clock_wait_us(100);
+        }
+    #endif
+    nrf_write(0x00, nrf_config);
+}
+
+#if ack_mode == 0 && tx_reuse == 1
+// blind burst of one payload, burst_packets of it: while CE is up the nRF sends
+// it back to back and each TX_DS wakes the MCU to count and clear it;
+// returns how many went out
+unsigned int nrf_burst(const byte *payload, byte width) {
+    nrf_command(0xA0, payload, 0, width); // W_TX_PAYLOAD
+    nrf_command(0xE3, 0, 0, 0); // REUSE_TX_PL
+    unsigned int sent = 0;
+    while (sent < burst_packets) {
+        events.irq = 0;
+        LATCE = 1;
+        for (byte i = 1; i <= burst_chunk; i++) {
+            if (!nrf_wait_irq()) {
+                return sent; // nrf_power_down() flushes what is left
+            }
+            if (i == burst_chunk - 1) {
+                LATCE = 0; // the packet under way ends the chunk
+            }
+            nrf_write(0x07, 0x20); // clear TX_DS
+            sent++;
+        }
+        timer_start(TIMER_BURST, 1);
+        while (!(timer_fired & (1 << TIMER_BURST))) {
+            INTCONbits.GIE = 0;
+            if (!events.timer1 && !spi_active) {
+                SLEEP();
+            }
+            INTCONbits.GIE = 1;
+            if (events.timer1) {
+                timers_run();
+            }
+        }
+        timer_fired &= ~(1 << TIMER_BURST);
+    }
+    return sent;
+}
+#endif
+
+#if ack_mode == 1
+// wait for the packet to be acknowledged (TX_DS) or
+// for the retransmits to run out (MAX_RT)
+byte nrf_wait_ack() {
+    byte irq = nrf_wait_irq(); // a timeout sets nrf_gone, ending the press
+
+    // clear the IRQ; STATUS comes back with the command
+    byte status = nrf_write(0x07, 0x70);
+
+    if (!irq || (status & 0x20) == 0) {
+        // MAX_RT (or a timeout, as good as one) leaves the payload in the
+        // TX FIFO
+        #if tx_reuse == 0
+            nrf_command(0xE1, 0, 0, 0); // FLUSH_TX
+        #endif
+        return 0;
+    }
+    #if tx_reuse == 1
+        tx_loaded = 0;
+    #endif
+    return 1;
+}
+#endif
 #endif
 
 #if mode == 1
+// With rx_power_down the nRF is powered up nrf_startup_us ahead of each
+// window; the window keeps its place in the listen schedule, just that
+// much after the wake-up. It goes back down once a window closes empty,
+// never straight after a packet, when it may still be sending the ACK.
+#define nrf_startup_ticks ((unsigned int)(((unsigned long)nrf_startup_us * timer1_ticks_per_s + 999999) / 1000000))
+byte nrf_powered = rx_power_down == 1 ? 0 : 1;
+
 void nrf_receive() {
+    #if wake_sync == 1
+        // the ACK carries the clock at this window's wake-up, replacing
+        // the one loaded for the last window if nothing came in then
+        byte ack[ack_payload_length];
+        ack[0] = governor.woke_at;
+        ack[1] = governor.woke_at >> 8;
+        ack[2] = governor.woke_at >> 16;
+        ack[3] = governor.woke_at >> 24;
+        #if channel_select == 1
+            ack[4] = channel_table[channel.next]; // where to find us next
+        #elif channel_select == 2
+            ack[4] = channel.hop; // where in hop_sequence this window is
+        #endif
+        #if rate_select == 1
+            ack[5] = channel.home_open ? rate_home : rate.next;
+        #endif
+        nrf_command(0xE1, 0, 0, 0); // FLUSH_TX
+        nrf_command(0xA8, ack, 0, ack_payload_length); // W_ACK_PAYLOAD, pipe 0
+    #endif
     LATCE = 1; // enable receiving
-    __delay_ms(1); // wait for a receive
-    LATCE = 0; // disable receiving
-    SLEEP(); // nothing received, go to sleep
+    stats_start(STAT_RX);
+    stats_add(windows, 1);
+    #if rate_select == 1
+        byte r = rate.tuned;
+    #else
+        byte r = rate_home;
+    #endif
+    #if carrier_detect == 1
+        if (!carrier_listen(r)) {
+            timer_fired |= 1 << TIMER_WINDOW; // the event loop closes it
+            return;
+        }
+    #endif
+    timer_start(TIMER_WINDOW, timer1_ticks(rate_window_ms(r)));
+}
+
+void nrf_listen() {
+    #if channel_select == 1
+        channel_tune(channel.current); // back from home, or moved
+        #if rate_select == 1
+            rate_tune(rate.current);
+        #endif
+    #elif channel_select == 2
+        channel_tune(hop_sequence[++channel.hop % hop_length]);
+    #endif
+    if (!nrf_powered) {
+        nrf_write(0x00, nrf_config | 0x02); // CONFIG: PWR_UP
+        nrf_powered = 1;
+        timer_start(TIMER_STARTUP, nrf_startup_ticks);
+        return;
+    }
+    nrf_receive();
+}
+
+void nrf_sleep() {
+    #if rx_power_down == 1
+        nrf_write(0x00, nrf_config); // CONFIG: PWR_UP off
+        nrf_powered = 0;
+    #endif
 }
 
 void nrf_postreceive() {
     LATCE = 0; // stop receiving please.
-    // perform check if any data was received (not sure if it's needed)
-    LATCSN = 0;
-    writeSPIByte(0x17);
-    byte status = writeSPIByte(0xFF);
-    LATCSN = 1;
-    if ((status & 0x01) == 0) { // if RX_FIFO not empty
-        // extract data from nrf into a buffer
-        LATCSN = 0;
-        writeSPIByte(0x61);
-        for (int j = receive_length-1; j >= 0; j--) {
-            receive_buffer[j] = writeSPIByte(0xFF);
-        }
-        LATCSN = 1;
+    stats_stop(STAT_RX);
+    timer_stop(TIMER_WINDOW);
+    // take everything the FIFO holds, STATUS tells each payload's pipe
+    byte pipe;
+    byte width;
+    while (!(nrf_read(0x17) & 0x01)) { // FIFO_STATUS: RX_EMPTY
+        byte *payload = rx_ring.payload[rx_ring.next];
+        #if command_frames == 1
+            // pipe 0 says how long the frame is, the group pipes are fixed
+            pipe = nrf_command(0x60, 0, &width, 1) >> 1 & 0x07; // R_RX_PL_WID
+            if (pipe != 0) {
+                width = receive_length;
+            } else if (width > receive_length) {
+                nrf_command(0xE2, 0, 0, 0); // FLUSH_RX, corrupt
+                break;
+            }
+            nrf_command(0x61, 0, payload, width); // R_RX_PAYLOAD
+        #else
+            width = receive_length;
+            pipe = nrf_command(0x61, 0, payload, width) >> 1 & 0x07; // R_RX_PAYLOAD
+        #endif
+        rx_ring_push(pipe, width);
     }
     // reset IRQ back to high
-    LATCSN = 0;
-    writeSPIByte(0x27);
-    writeSPIByte(0xFF);
-    LATCSN = 1;
+    nrf_write(0x07, 0xFF);
     NOP(); // for debugging purposes
-    // decode received message into a command
-    byte on_count = 0;
-    byte off_count = 0;
-    for (byte i=0; i<receive_length; i++) {
-        if (receive_buffer[i] == CHAR_ON) {
-            on_count++;
-        } else if (receive_buffer[i] == CHAR_OFF) {
-            off_count++;
+    // decide the command by a vote across what has come in
+    byte sequence = 0;
+    char command = rx_ring_vote(&pipe, &sequence);
+    if (command) {
+        rx_ring_clear(); // decided, the rest is more of the same burst
+    }
+    #if rate_select == 1 || carrier_detect == 1
+        byte strong = command && (nrf_read(0x09) & 0x01); // RPD
+    #endif
+    #if rate_select == 1
+        if (command) {
+            rate_heard(strong, channel.home_open);
+        }
+    #endif
+    #if carrier_detect == 1
+        if (command) {
+            carrier_heard(strong);
+        }
+    #endif
+    #if channel_select > 0
+        if (command) {
+            channel_heard();
         }
+    #endif
+    if (command && dedup_seen(pipe, sequence)) {
+        return; // this press has been acted on, back to sleep
     }
-    if (on_count >= correctness_threshold) {
-        LATLED = 1;
-        relay_1();
-        SLEEP();
-    } else if (off_count >= correctness_threshold) {
-        LATLED = 0;
-        relay_n();
-        SLEEP();
+    if (command) {
+        stats_add(commands, 1);
+    }
+    if (command == CHAR_ON || command == CHAR_OFF) {
+        governor_hit();
+        led_show(command);
+        relay_start(command);
+    #if command_frames == 1
+    } else if (command == CHAR_SKIP) {
+        // a good frame, just nothing in it for this switch
+    #endif
     } else {
         nrf_receive();
     }
@@ -361,60 +2604,452 @@ void nrf_postreceive() {
 #endif
 
 void __interrupt() int_handler() {
+    TMR0 = 0;
+    INTCONbits.TMR0IF = 0;
+
+    if (PIE1bits.SSPIE && PIR1bits.SSPIF) {
+        spi_interrupt(); // keep the SPI queue moving first
+    }
     if (IOCBFbits.IOCBF0) {
         IOCBF &= 0b11111110;
-        // IRQ can be set when a packet is received...
-        #if mode == 1
-            nrf_postreceive();
-        #endif
-        // ...or when an ACK is received (disabled currently)
-        return;
+        // IRQ can be set when a packet is received
+        // or when an ACK is received
+        events.irq = 1;
     }
+    #if stats == 1
+        if (IOCBFbits.IOCBF1) {
+            IOCBF &= 0b11111101;
+            events.dump = 1;
+        }
+        if (PIE1bits.TXIE && PIR1bits.TXIF) {
+            stats_dump_byte();
+        }
+    #endif
     if (PIR1bits.TMR1IF == 1) {
-        timer1_reset();
         PIR1bits.TMR1IF = 0;
-        #if mode == 1
+        events.timer1 = 1;
+    }
+
+    byte took = INTCONbits.TMR0IF ? 255 : TMR0;
+    if (took > isr_worst) {
+        isr_worst = took;
+    }
+    stats_add(isr_ticks, took);
+    stats_add(interrupts, 1);
+}
+
+#if mode == 1
+/* <EVENT LOOP> */
+
+void event_loop() {
+    timer_start(TIMER_LISTEN, governor.period);
+    while (1) {
+        if (events.timer1) {
+            timers_run();
+        }
+        if (events.irq) {
+            events.irq = 0;
+            nrf_postreceive();
+        }
+        if (timer_fired & (1 << TIMER_LISTEN)) {
+            timer_fired &= ~(1 << TIMER_LISTEN);
+            governor_wake();
+            battery_wake();
+            timer_start(TIMER_LISTEN, governor.period);
+            nrf_listen();
+        }
+        if (timer_fired & (1 << TIMER_STARTUP)) {
+            timer_fired &= ~(1 << TIMER_STARTUP);
             nrf_receive();
+        }
+        if (timer_fired & (1 << TIMER_WINDOW)) {
+            timer_fired &= ~(1 << TIMER_WINDOW);
+            #if channel_select > 0
+                channel_sample(); // while still receiving
+            #endif
+            LATCE = 0; // nothing received, disable receiving
+            stats_stop(STAT_RX);
+            stats_add(empty_windows, 1);
+            rx_ring_clear(); // what it holds is from an earlier burst
+            #if channel_select == 1
+                if (channel_closed()) {
+                    nrf_receive(); // another window, on home
+                } else {
+                    nrf_sleep();
+                }
+            #else
+                nrf_sleep();
+            #endif
+        }
+        if (timer_fired & (1 << TIMER_RELAY)) {
+            timer_fired &= ~(1 << TIMER_RELAY);
+            relay_step();
+        }
+        if (timer_fired & (1 << TIMER_DEDUP)) {
+            timer_fired &= ~(1 << TIMER_DEDUP);
+            dedup_clear();
+        }
+        if (timer_fired & (1 << TIMER_LED)) {
+            timer_fired &= ~(1 << TIMER_LED);
+            led_step();
+        }
+        #if stats == 1
+            if (events.dump) {
+                events.dump = 0;
+                stats_dump();
+            }
+            if (stats_sending) {
+                stats_dump_end(); // polls TRMT, the loop doesn't sleep
+            }
         #endif
+
+        // with GIE off an interrupt still wakes SLEEP() up (or turns it
+        // into a NOP if it came in after the checks) and is handled
+        // once GIE is back on
+        INTCONbits.GIE = 0;
+        if (!events.irq && !events.timer1 && !events.dump && !timer_fired && !spi_active
+            && !stats_sending) {
+            stats_start(STAT_SLEEP);
+            SLEEP();
+            stats_stop(STAT_SLEEP);
+        }
+        INTCONbits.GIE = 1;
     }
 }
+#endif
 
 #if mode == 0
-void button_action() {
-    LATLED = out; // LED signal
-    if (out == 0) {
-        for (int i=0; i<5050; i++) {
-            nrf_transmit(CHAR_OFF);
+// target whose address the radio holds, nrf_setup() loads the first
+byte target_current = 0;
+
+#if channel_select > 0
+#if channel_select == 1
+// RF_CH each switch announced in its last ACK, 0 until one came
+byte target_channel[target_count];
+#endif
+byte channel_tuned = channel_home; // RF_CH the radio holds
+
+void channel_tune(byte ch) {
+    if (ch != channel_tuned) {
+        nrf_write(0x05, ch); // RF_CH
+        channel_tuned = ch;
+    }
+}
+
+#if rate_select == 1
+byte target_rate[target_count]; // rate each switch announced, see main()
+byte rate_tuned = rate_home;
+
+void rate_tune(byte r) {
+    if (r != rate_tuned) {
+        nrf_write(0x06, (nrf_read(0x06) & ~0x28) | rate_bits(r)); // RF_SETUP
+        nrf_write(0x04, rate_retr(r)); // SETUP_RETR
+        rate_tuned = r;
+    }
+}
+#endif
+
+// a switch that doesn't ACK where it was, or that another remote has
+// moved, listens on home at least every home_every * listen_idle_ms
+#define home_burst_ticks timer1_ticks(home_every * listen_idle_ms + listen_idle_ms)
+#endif
+
+// point the radio at a target; the rest of the configuration stays
+void target_select(byte t) {
+    #if channel_select == 1
+        channel_tune(target_channel[t] ? target_channel[t] : channel_home);
+        #if rate_select == 1
+            rate_tune(target_rate[t]);
+        #endif
+    #elif channel_select == 2
+        channel_tune(channel_home); // button_action() hops from there
+    #endif
+    if (t == target_current) {
+        return;
+    }
+    nrf_command(0x30, targets[t].address, 0, 5); // TX_ADDR
+    #if ack_mode == 1
+        nrf_command(0x2A, targets[t].address, 0, 5); // RX_ADDR_P0 for the ACKs
+    #endif
+    target_current = t;
+}
+
+// how many nrf_transmit() calls (packets with tx_reuse) the last press took
+unsigned int burst_sent = 0;
+// sent with every press so the switch can drop the repeats
+byte press_sequence = 0;
+
+#if wake_sync == 1
+/* <WAKE SYNC> */
+
+// Every ACK carries the switch's Timer1 clock at the wake-up of the
+// window it answers from. Two of them a few seconds apart give the rate
+// of its LFINTOSC against ours (skew, 1/65536 units), and with that the
+// remote works out the switch's next window after a press and sleeps
+// until then instead of bursting through a whole listen period. own_at
+// is our clock at the ACK, so the aim is the same spot in the window
+// that got through last time. The schedule is the one governor_hit()
+// starts: fast wake-ups counted from the heard one, then normal ones.
+#define sync_fast_ticks timer1_ticks(listen_fast_ms)
+#define sync_normal_ticks timer1_ticks(listen_normal_ms)
+#define sync_fast_span ((listen_fast_hold_s * 1000UL / listen_fast_ms) * sync_fast_ticks)
+#define sync_calibrate_ticks 8192 // shortest gap to rate the switch's clock on
+#define sync_slack_ticks timer1_ticks(2) // where in its window the ACK fell
+
+struct {
+    unsigned long own_at; // our clock at the last ACK
+    unsigned long switch_at; // the switch's wake-up it came from
+    int skew; // switch ticks gained per 65536 of ours
+    byte heard; // own_at/switch_at are valid
+    byte rated; // skew is valid
+    #if channel_select == 2
+        byte hop; // its place in hop_sequence then
+    #endif
+} sync[target_count];
+
+// take the clock (and channel) off the ACK payload nrf_wait_ack() left
+// in the RX FIFO
+void sync_heard(byte t) {
+    if (nrf_read(0x17) & 0x01) { // FIFO_STATUS: RX_EMPTY
+        return; // a switch built without wake_sync
+    }
+    byte width;
+    nrf_command(0x60, 0, &width, 1); // R_RX_PL_WID
+    byte ack[ack_payload_length];
+    byte valid = width >= 4 && width <= ack_payload_length;
+    if (valid) {
+        nrf_command(0x61, 0, ack, width); // R_RX_PAYLOAD
+    }
+    nrf_command(0xE2, 0, 0, 0); // FLUSH_RX
+    if (!valid) {
+        return;
+    }
+    #if channel_select == 1
+        // a switch built without channel_select sends just the clock
+        if (width >= 5 && ack[4] < 126) {
+            target_channel[t] = ack[4];
+        }
+        #if rate_select == 1
+            if (width == 6 && ack[5] < 3) {
+                target_rate[t] = ack[5];
+            }
+        #endif
+    #elif channel_select == 2
+        sync[t].hop = width == 5 ? ack[4] : 0;
+    #endif
+    unsigned long now = timer1_now();
+    unsigned long theirs = ack[0] | (unsigned int)ack[1] << 8
+            | (unsigned long)ack[2] << 16 | (unsigned long)ack[3] << 24;
+    if (sync[t].heard && now - sync[t].own_at >= sync_calibrate_ticks) {
+        unsigned long own = now - sync[t].own_at;
+        unsigned long their = theirs - sync[t].switch_at;
+        while (own > 0xFFFF) {
+            own >>= 1;
+            their >>= 1;
         }
+        long gained = (long)their - (long)own;
+        // anything past +-1/3 is a restarted switch, not a slow clock
+        if (gained <= (long)own / 3 && -gained <= (long)own / 3) {
+            sync[t].skew = gained * 65536 / (long)own;
+            sync[t].rated = 1;
+        }
+    }
+    sync[t].own_at = now;
+    sync[t].switch_at = theirs;
+    sync[t].heard = 1;
+}
+
+// our clock span around the switch's next window at least lead ticks
+// away; returns how many wake-ups after the heard one that is, 0 when
+// the drift since the last ACK has eaten the period
+unsigned int sync_plan(byte t, unsigned int lead, unsigned long *from, unsigned long *until) {
+    if (!sync[t].heard || !sync[t].rated) {
+        return 0;
+    }
+    unsigned long own = timer1_now() - sync[t].own_at + lead;
+    if (own > 0xFFFF) {
+        return 0; // also the reach of a one-shot timer
+    }
+    long skew = sync[t].skew;
+    unsigned long theirs = own + (long)own * skew / 65536;
+    unsigned long window;
+    unsigned int wakes;
+    if (theirs < sync_fast_span) {
+        wakes = theirs / sync_fast_ticks + 1;
+        window = wakes * sync_fast_ticks;
     } else {
-        for (int i=0; i<5050; i++) {
-            nrf_transmit(CHAR_ON);
+        unsigned int normal = (theirs - sync_fast_span) / sync_normal_ticks + 1;
+        wakes = sync_fast_span / sync_fast_ticks + normal;
+        window = sync_fast_span + normal * sync_normal_ticks;
+    }
+    unsigned long at = window - (long)window * skew / (65536 + skew);
+    unsigned int tol = at * sync_drift_ppm / 1000000UL + sync_slack_ticks;
+    if (2 * tol >= (theirs < sync_fast_span ? sync_fast_ticks : sync_normal_ticks)) {
+        return 0; // could be the window either side
+    }
+    *from = sync[t].own_at + at - tol;
+    *until = sync[t].own_at + at + tol;
+    return wakes;
+}
+
+// sleep until our clock reads at, the buttons wait
+void sync_sleep(unsigned long at) {
+    unsigned long now = timer1_now();
+    if ((long)(at - now) <= 0) {
+        return;
+    }
+    timer_start(TIMER_SYNC, at - now);
+    while (!(timer_fired & (1 << TIMER_SYNC))) {
+        INTCONbits.GIE = 0;
+        if (!events.timer1 && !spi_active) {
+            SLEEP();
         }
+        INTCONbits.GIE = 1;
+        if (events.timer1) {
+            timers_run();
+        }
+    }
+    timer_fired &= ~(1 << TIMER_SYNC);
+}
+#endif
+
+// group targets never ACK, so in ack mode their burst runs all
+// ack_attempts, which is about as long as the blind one
+void button_action(byte t) {
+    if (nrf_setup_errors == 0xFF) {
+        return; // no nRF answered at power-up
     }
+    #if wake_sync == 1
+        // the nRF goes up timer1_ticks(2) ahead of the planned span
+        unsigned long from, until;
+        unsigned int planned = sync_plan(t, timer1_ticks(2) + 1, &from, &until);
+        if (planned) {
+            sync_sleep(from - timer1_ticks(2));
+        }
+    #endif
+    LATLED = 1; // LED signal, only while sending
+    nrf_power_up();
+    target_select(t);
+    byte payload[receive_length];
+    press_sequence++;
+    #if command_frames == 1
+        byte width = frame_encode(t, press_sequence, payload);
+    #else
+        byte width = receive_length;
+        payload_encode(out[t] ? CHAR_ON : CHAR_OFF, press_sequence, payload);
+    #endif
+    burst_sent = 0;
+    #if ack_mode == 1
+        byte acked = 0;
+        #if wake_sync == 1
+            #if channel_select == 2
+                if (planned) {
+                    channel_tune(channel_table[hop_sequence[(byte)(sync[t].hop + planned) % hop_length]]);
+                }
+            #endif
+            // aimed at the window; a miss falls back to the full burst
+            while (planned && !acked && !nrf_gone && (long)(until - timer1_now()) > 0) {
+                nrf_transmit(payload, width);
+                burst_sent++;
+                acked = nrf_wait_ack();
+            }
+            #if channel_select == 2
+                channel_tune(channel_home);
+            #endif
+        #endif
+        for (byte i=0; i<ack_attempts && !acked && !nrf_gone; i++) {
+            nrf_transmit(payload, width);
+            burst_sent++;
+            acked = nrf_wait_ack(); // the switch has it
+        }
+        #if channel_select > 0
+            #if rate_select == 1
+                byte home = !acked && (channel_tuned != channel_home || !target_channel[t]
+                        || rate_tuned != rate_home);
+            #elif channel_select == 1
+                byte home = !acked && (channel_tuned != channel_home || !target_channel[t]);
+            #else
+                byte home = !acked; // it hopped past home
+            #endif
+            if (home) {
+                channel_tune(channel_home);
+                #if rate_select == 1
+                    rate_tune(rate_home);
+                #endif
+                unsigned long home_until = timer1_now() + home_burst_ticks;
+                while (!acked && !nrf_gone && (long)(home_until - timer1_now()) > 0) {
+                    nrf_transmit(payload, width);
+                    burst_sent++;
+                    acked = nrf_wait_ack();
+                }
+            }
+        #endif
+        #if wake_sync == 1
+            if (acked) {
+                sync_heard(t);
+            } else {
+                sync[t].heard = 0;
+            }
+        #endif
+    #else
+        #if tx_reuse == 1
+            burst_sent = nrf_burst(payload, width);
+        #else
+            for (int i=0; i<burst_length; i++) {
+                nrf_transmit(payload, width);
+                burst_sent++;
+                clock_wait_us(burst_gap_us);
+            }
+        #endif
+    #endif
+    nrf_power_down();
+    LATLED = 0;
 }
 #endif
 
 #if mode == 0
-void watch_input(void(*action_func)()) {
-    // remember the last 2 values of the input
+// Between presses the MCU sleeps with only Timer1 running and the nRF
+// powered down. PORTC has no interrupt-on-change on the PIC16F1519, so
+// TIMER_BUTTON wakes it every button_poll_ms to look at the buttons.
+void watch_input(void(*action_func)(byte)) {
+    // remember the last 2 looks at the inputs
     // for noise-free edge detection
-    char tailInput = 1;
-    char lastInput = 1;
+    byte tailInput = 0xFF;
+    byte lastInput = 0xFF;
+
+    for (byte t = 0; t < target_count; t++) {
+        out[t] = 1;
+    }
 
     // watch loop
+    timer_start(TIMER_BUTTON, timer1_ticks(button_poll_ms));
     while (1) {
-        const unsigned int noise_wait = 50; // ms
-        char currentInput = PORTCbits.RC2;
+        if (events.timer1) {
+            timers_run();
+        }
+        if (timer_fired & (1 << TIMER_BUTTON)) {
+            timer_fired &= ~(1 << TIMER_BUTTON);
+            timer_start(TIMER_BUTTON, timer1_ticks(button_poll_ms));
+            byte currentInput = PORTC;
 
-        // falling edge
-        if (tailInput == 1 && lastInput == 0 && currentInput == 0) {
-            button_action();
-            out = !out;
+            for (byte t = 0; t < target_count; t++) {
+                byte mask = 1 << targets[t].button;
+                // falling edge
+                if ((tailInput & mask) && !(lastInput & mask) && !(currentInput & mask)) {
+                    action_func(t);
+                    out[t] = !out[t];
+                }
+            }
+
+            tailInput = lastInput;
+            lastInput = currentInput;
         }
 
-        tailInput = lastInput;
-        lastInput = currentInput;
-        __delay_ms(noise_wait);
+        INTCONbits.GIE = 0;
+        if (!events.timer1 && !timer_fired && !spi_active) {
+            SLEEP();
+        }
+        INTCONbits.GIE = 1;
     }
 }
 #endif
@@ -423,11 +3058,17 @@ void led_setup() {
     TRISDbits.TRISD2 = 0; // output LED
     TRISCbits.TRISC2 = 1; // input BUTTON
     ANSELCbits.ANSC2 = 0; // digital read C2
+    #if mode == 0
+        for (byte t = 0; t < target_count; t++) {
+            TRISC |= 1 << targets[t].button; // input BUTTON
+            ANSELC &= ~(1 << targets[t].button); // digital read
+        }
+    #endif
     LATLED = 0;
 }
 
 void main() {
-    OSCCON = 0b01110010; // set oscillator settings
+    clock_fast();
 
     #if mode == 1
         relay_setup();
@@ -438,11 +3079,22 @@ void main() {
     int_setup();
 
     #if mode == 0
+        #if rate_select == 1
+            for (byte t = 0; t < target_count; t++) {
+                target_rate[t] = rate_home;
+            }
+        #endif
+        timer1_setup();
         watch_input(&button_action);
     #endif
     #if mode == 1
+        latch_load();
+        #if rate_select == 1
+            rate_load();
+        #endif
+        battery_check();
         timer1_setup();
-        SLEEP();
+        event_loop();
     #endif
 }
 